@@ -0,0 +1,281 @@
+/*
+ * Copyright (c) 2012, Matt Hellige
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above copyright notice, 
+ *   this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above copyright 
+ *   notice, this list of conditions and the following disclaimer in the 
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR 
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT 
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, 
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY 
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dcpu.h"
+#include "opcodes.h"
+
+// batch mode: many copies of one image, each with its own ram (mapped
+// copy-on-write, so they share what they don't write) and no devices, run
+// headless for a budget of cycles. lane i starts with A=i and B=the number of
+// lanes, which is all that tells them apart.
+//
+// lanes are run BATCH_LANES at a time, with their registers kept in
+// structure-of-arrays form so that when they're all at the same pc, running
+// the same instruction, it can be done for all of them at once with vector
+// operations. that's only done for simple arithmetic on registers and
+// literals, which is most of what tight compute loops are made of; anything
+// else, and any lane that's off on its own, goes through dcpu_step() as
+// usual.
+//
+// lanes that branch different ways have to be brought back into step, or
+// they'd stay apart for good. so each round, only the lanes furthest behind
+// (at the lowest pc) run. the rest wait, usually at the end of an if or a
+// loop, until the stragglers catch up and join them. the lanes share
+// nothing, so the order they run in can't change their results.
+//
+// the vectors are gcc's generic vector types, which compile to sse2 on
+// x86-64 out of the box and to avx2 or avx-512 if CFLAGS allow it (say, with
+// -march=native), or plain scalar code elsewhere.
+
+#define BATCH_LANES 16
+
+typedef u16 lanes_t __attribute__((vector_size(BATCH_LANES * sizeof(u16))));
+typedef uint32_t wide_t
+  __attribute__((vector_size(BATCH_LANES * sizeof(uint32_t))));
+
+struct batch_t {
+  int n; // lanes in use
+  dcpu *cpus[BATCH_LANES];
+  bool running[BATCH_LANES];
+
+  // the registers of every lane, authoritative while the lane is in soa
+  // form. pc, sp and ex aren't touched by vector code except to advance pc,
+  // but live here too so lanes can be grouped without looking at each cpu.
+  lanes_t reg[NREGS];
+  lanes_t ex;
+  u16 pc[BATCH_LANES];
+
+  uint64_t vectored, scalar; // instructions
+};
+
+// move a lane's registers between the cpu and the arrays
+static void unpack(struct batch_t *b, int i) {
+  dcpu *dcpu = b->cpus[i];
+  for (int r = 0; r < NREGS; r++) dcpu->reg[r] = b->reg[r][i];
+  dcpu->ex = b->ex[i];
+  dcpu->pc = b->pc[i];
+}
+
+static void pack(struct batch_t *b, int i) {
+  dcpu *dcpu = b->cpus[i];
+  for (int r = 0; r < NREGS; r++) b->reg[r][i] = dcpu->reg[r];
+  b->ex[i] = dcpu->ex;
+  b->pc[i] = dcpu->pc;
+}
+
+// whether instr can run in vector form: one of the ops below, with a
+// register as b, and a register or literal as a.
+static bool vectorable(u16 instr) {
+  switch (get_opcode(instr)) {
+    case OP_SET: case OP_ADD: case OP_SUB: case OP_MUL:
+    case OP_AND: case OP_BOR: case OP_XOR:
+      break;
+    default:
+      return false;
+  }
+  uint8_t a = arg_a(instr);
+  return arg_b(instr) < 0x08 && (a < 0x08 || a >= 0x1f);
+}
+
+// run instr for the lanes in mask, all at the same pc. returns its length.
+static u16 vector_step(struct batch_t *b, const lanes_t *mask, u16 instr,
+    u16 next) {
+  uint8_t areg = arg_a(instr), breg = arg_b(instr);
+  lanes_t a, bv = b->reg[breg], res, ex = b->ex;
+  u16 len = 1, cost = 1;
+
+  if (areg < 0x08) {
+    a = b->reg[areg];
+  } else if (areg == 0x1f) {
+    a = (lanes_t){ 0 } + next;
+    len = 2;
+    cost += 2; // as decode_arg() has it
+  } else {
+    a = (lanes_t){ 0 } + (u16)(areg - 0x21);
+  }
+
+  switch (get_opcode(instr)) {
+    case OP_SET:
+      res = a;
+      break;
+    case OP_ADD:
+      res = bv + a;
+      ex = (lanes_t)(res < bv) & 1;
+      cost++;
+      break;
+    case OP_SUB:
+      res = bv - a;
+      ex = (lanes_t)(bv < a);
+      cost++;
+      break;
+    case OP_MUL: {
+      wide_t prod = __builtin_convertvector(bv, wide_t)
+        * __builtin_convertvector(a, wide_t);
+      res = __builtin_convertvector(prod, lanes_t);
+      ex = __builtin_convertvector(prod >> 16, lanes_t);
+      cost++;
+      break;
+    }
+    case OP_AND:
+      res = bv & a;
+      break;
+    case OP_BOR:
+      res = bv | a;
+      break;
+    default: // OP_XOR
+      res = bv ^ a;
+      break;
+  }
+
+  b->reg[breg] = (res & *mask) | (bv & ~*mask);
+  b->ex = (ex & *mask) | (b->ex & ~*mask);
+  for (int i = 0; i < b->n; i++)
+    if ((*mask)[i]) b->cpus[i]->cycles += cost;
+  return len;
+}
+
+static bool scalar_step(struct batch_t *b, int i, uint64_t budget) {
+  dcpu *dcpu = b->cpus[i];
+  unpack(b, i);
+  action_t action = dcpu_step(dcpu);
+  b->scalar++;
+  // a lane halts on a single-instruction loop, like the debugger's -l, but
+  // there's no need to say so every time
+  bool looped = dcpu->pc == b->pc[i];
+  pack(b, i);
+  return action == A_CONTINUE && !looped && dcpu->cycles < budget;
+}
+
+static bool pending(dcpu *dcpu) {
+  return dcpu->intqread != dcpu->intqwrite;
+}
+
+static void run(struct batch_t *b, uint64_t budget, bool vector) {
+  for (int i = 0; i < b->n; i++) {
+    pack(b, i);
+    b->running[i] = true;
+  }
+
+  for (;;) {
+    // the lanes furthest behind go, led by the first of them
+    int lead = -1;
+    for (int i = 0; i < b->n; i++)
+      if (b->running[i] && (lead < 0 || b->pc[i] < b->pc[lead])) lead = i;
+    if (lead < 0) break;
+
+    dcpu *ld = b->cpus[lead];
+    u16 pc = b->pc[lead], instr = ld->ram[pc], next = ld->ram[(u16)(pc + 1)];
+    lanes_t mask = { 0 };
+    int members = 0;
+    if (vector && vectorable(instr)) {
+      for (int i = lead; i < b->n; i++) {
+        dcpu *dcpu = b->cpus[i];
+        if (b->running[i] && b->pc[i] == pc && dcpu->ram[pc] == instr
+            && (arg_a(instr) != 0x1f || dcpu->ram[(u16)(pc + 1)] == next)
+            && !pending(dcpu)) {
+          mask[i] = 0xffff;
+          members++;
+        }
+      }
+    }
+
+    if (members > 1) {
+      u16 len = vector_step(b, &mask, instr, next);
+      b->vectored += members;
+      for (int i = 0; i < b->n; i++) {
+        if (!mask[i]) continue;
+        b->pc[i] += len;
+        if (b->cpus[i]->cycles >= budget) b->running[i] = false;
+      }
+    } else {
+      mask = (lanes_t){ 0 };
+    }
+
+    // the rest of them take a step on their own
+    for (int i = lead; i < b->n; i++)
+      if (b->running[i] && b->pc[i] == pc && !mask[i])
+        b->running[i] = scalar_step(b, i, budget);
+  }
+
+  for (int i = 0; i < b->n; i++) unpack(b, i);
+}
+
+// run n copies of the image mapped from base, for up to budget cycles each,
+// and print each one's final registers to stdout. with vector false,
+// everything goes through dcpu_step(), for comparison.
+void dcpu_runbatch(int n, int base, uint64_t budget, bool vector) {
+  struct batch_t b;
+  uint64_t vectored = 0, scalar = 0;
+  unsigned written = 0, pages = 0;
+  tstamp_t start = dcpu_now();
+
+  for (int first = 0; first < n; first += BATCH_LANES) {
+    memset(&b, 0, sizeof(b));
+    b.n = n - first < BATCH_LANES ? n - first : BATCH_LANES;
+    for (int i = 0; i < b.n; i++) {
+      dcpu *dcpu = b.cpus[i] = malloc(sizeof(*dcpu));
+      dcpu_init(dcpu, 1);
+      if (!dcpu_mapram(dcpu, base)) exit(1);
+      dcpu->unpaced = true;
+      dcpu->detect_loops = false;
+      dcpu->reg[REG_A] = first + i;
+      dcpu->reg[REG_B] = n;
+    }
+
+    run(&b, budget, vector);
+
+    for (int i = 0; i < b.n; i++) {
+      dcpu *dcpu = b.cpus[i];
+      printf("lane %d: %s after %" PRIu64 " cycles: pc=%04x sp=%04x ex=%04x"
+          " a=%04x b=%04x c=%04x x=%04x y=%04x z=%04x i=%04x j=%04x\n",
+          first + i, dcpu->cycles < budget ? "halted" : "stopped",
+          dcpu->cycles, dcpu->pc, dcpu->sp, dcpu->ex,
+          dcpu->reg[0], dcpu->reg[1], dcpu->reg[2], dcpu->reg[3],
+          dcpu->reg[4], dcpu->reg[5], dcpu->reg[6], dcpu->reg[7]);
+      unsigned own, total;
+      if (dcpu_ramstats(dcpu, &own, &total)) {
+        written += own;
+        pages += total;
+      }
+      dcpu_killram(dcpu);
+      free(dcpu);
+    }
+    vectored += b.vectored;
+    scalar += b.scalar;
+  }
+
+  double secs = (dcpu_now() - start) / 1e9;
+  fprintf(stderr, "%d lanes in %.3fs: %" PRIu64 " instructions in vector "
+      "form, %" PRIu64 " one at a time\n", n, secs, vectored, scalar);
+  // how much the lanes' ram diverged from the shared image, all told
+  if (pages)
+    fprintf(stderr, "%u of %u pages of ram written\n", written, pages);
+}
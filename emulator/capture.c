@@ -0,0 +1,307 @@
+/*
+ * Copyright (c) 2012, Matt Hellige
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above copyright notice, 
+ *   this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above copyright 
+ *   notice, this list of conditions and the following disclaimer in the 
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR 
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT 
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, 
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY 
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dcpu.h"
+#include "lem.h"
+
+// a headless lem1802. rather than drawing to a window, it rasterizes the
+// display into memory at chosen points in (emulated) time, and writes the
+// results out as image files or a raw video stream. everything is driven by
+// the cycle count, so output is reproducible regardless of host speed.
+
+struct capture_t {
+  lem_regs regs;
+  lem_frame frame;
+  uint32_t fb[LEM_HEIGHT * LEM_WIDTH]; // 0xrrggbb
+  uint8_t rgb[LEM_HEIGHT * LEM_WIDTH * 3];
+  uint64_t hz;
+
+  // single frames
+  uint64_t *at;
+  int nat;
+  int nextat;
+  const char *prefix;
+  bool png;
+
+  // video stream
+  FILE *stream;
+  uint64_t framecycles;
+  uint64_t nextframe;
+};
+
+static struct capture_t cap;
+
+static u16 capture_hwi(dcpu *dcpu, device *dev) {
+  (void)dev;
+  return lem_runhwi(&cap.regs, dcpu);
+}
+
+static size_t capture_save(dcpu *dcpu, device *dev, void *buf, size_t len) {
+  (void)dcpu; (void)dev;
+  return lem_saveregs(&cap.regs, buf, len);
+}
+
+static bool capture_restore(dcpu *dcpu, device *dev, const void *buf,
+    size_t len) {
+  (void)dcpu; (void)dev;
+  return lem_restoreregs(&cap.regs, buf, len);
+}
+
+static void fill(int x, int y, int w, int h, uint32_t col) {
+  for (int j = y; j < y + h; j++)
+    for (int i = x; i < x + w; i++)
+      cap.fb[j * LEM_WIDTH + i] = col;
+}
+
+static void rasterize(dcpu *dcpu) {
+  lem_frame *frame = &cap.frame;
+  lem_snapshot(dcpu, &cap.regs, frame);
+
+  uint32_t pal[16];
+  for (int i = 0; i < 16; i++) pal[i] = lem_rgb(frame->palette[i]);
+
+  uint32_t border = pal[frame->regs.border];
+  fill(0, 0, LEM_WIDTH, SCR_BORDER, border);
+  fill(0, LEM_HEIGHT - SCR_BORDER, LEM_WIDTH, SCR_BORDER, border);
+  fill(0, SCR_BORDER, SCR_BORDER, LEM_HEIGHT - 2*SCR_BORDER, border);
+  fill(LEM_WIDTH - SCR_BORDER, SCR_BORDER, SCR_BORDER,
+      LEM_HEIGHT - 2*SCR_BORDER, border);
+
+  if (!frame->regs.vram) {
+    // unmapped. just show black.
+    fill(SCR_BORDER, SCR_BORDER, LEM_WIDTH - 2*SCR_BORDER,
+        LEM_HEIGHT - 2*SCR_BORDER, 0);
+  } else {
+    // blink phase follows emulated time, starting visible, just like the
+    // interactive displays.
+    bool blinkon = !((dcpu->cycles * BLINK_HZ / cap.hz) & 1);
+    int pitch = LEM_WIDTH * sizeof(uint32_t);
+    for (int i = 0; i < SCR_HEIGHT; i++) {
+      for (int j = 0; j < SCR_WIDTH; j++) {
+        u16 word = frame->vram[i * SCR_WIDTH + j];
+        uint8_t *base = (uint8_t *)&cap.fb[(i * 8 + SCR_BORDER) * LEM_WIDTH
+            + j * 4 + SCR_BORDER];
+        lem_drawcell(base, pitch, 1, lem_glyph(frame, word, blinkon),
+            pal[word >> 12], pal[(word >> 8) & 0xf]);
+      }
+    }
+  }
+
+  uint8_t *out = cap.rgb;
+  for (int i = 0; i < LEM_HEIGHT * LEM_WIDTH; i++) {
+    *out++ = cap.fb[i] >> 16;
+    *out++ = cap.fb[i] >> 8;
+    *out++ = cap.fb[i];
+  }
+}
+
+static void put32(uint8_t *p, uint32_t n) {
+  p[0] = n >> 24; p[1] = n >> 16; p[2] = n >> 8; p[3] = n;
+}
+
+static uint32_t crc32(uint32_t crc, const uint8_t *buf, size_t len) {
+  static uint32_t table[256];
+  if (!table[1]) {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++) c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+      table[i] = c;
+    }
+  }
+  crc = ~crc;
+  while (len--) crc = table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+static void chunk(FILE *f, const char *type, const uint8_t *data, size_t len) {
+  uint8_t hdr[8];
+  put32(hdr, len);
+  memcpy(hdr + 4, type, 4);
+  uint32_t crc = crc32(crc32(0, hdr + 4, 4), data, len);
+  fwrite(hdr, 1, 8, f);
+  if (len) fwrite(data, 1, len, f);
+  put32(hdr, crc);
+  fwrite(hdr, 1, 4, f);
+}
+
+// we have no zlib, so the image data is wrapped in uncompressed ("stored")
+// deflate blocks. the files are bigger than they need to be, but any png
+// reader will take them.
+static void write_png(FILE *f) {
+  static const uint8_t sig[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+  fwrite(sig, 1, sizeof(sig), f);
+
+  uint8_t ihdr[13];
+  put32(ihdr, LEM_WIDTH);
+  put32(ihdr + 4, LEM_HEIGHT);
+  ihdr[8] = 8;  // bit depth
+  ihdr[9] = 2;  // truecolor
+  ihdr[10] = 0; // deflate
+  ihdr[11] = 0; // adaptive filtering
+  ihdr[12] = 0; // no interlace
+  chunk(f, "IHDR", ihdr, sizeof(ihdr));
+
+  // raw scanlines, each preceded by filter type 0
+  enum { STRIDE = LEM_WIDTH * 3 + 1, RAW = STRIDE * LEM_HEIGHT };
+  static uint8_t raw[RAW];
+  for (int y = 0; y < LEM_HEIGHT; y++) {
+    raw[y * STRIDE] = 0;
+    memcpy(raw + y * STRIDE + 1, cap.rgb + y * LEM_WIDTH * 3, STRIDE - 1);
+  }
+
+  static uint8_t idat[2 + RAW + 5 * (RAW / 0xffff + 1) + 4];
+  uint8_t *p = idat;
+  *p++ = 0x78; *p++ = 0x01; // zlib header, no compression
+  uint32_t a = 1, b = 0;
+  for (size_t off = 0; off < RAW; ) {
+    size_t n = RAW - off > 0xffff ? 0xffff : RAW - off;
+    *p++ = off + n == RAW; // final block?
+    *p++ = n; *p++ = n >> 8; *p++ = ~n; *p++ = ~n >> 8;
+    memcpy(p, raw + off, n);
+    for (size_t i = 0; i < n; i++) {
+      a = (a + raw[off + i]) % 65521;
+      b = (b + a) % 65521;
+    }
+    p += n;
+    off += n;
+  }
+  put32(p, (b << 16) | a);
+  p += 4;
+  chunk(f, "IDAT", idat, p - idat);
+  chunk(f, "IEND", NULL, 0);
+}
+
+static void write_frame(uint64_t cycles) {
+  char name[FILENAME_MAX];
+  snprintf(name, sizeof(name), "%s%llu.%s", cap.prefix,
+      (unsigned long long)cycles, cap.png ? "png" : "ppm");
+  FILE *f = fopen(name, "wb");
+  if (!f) {
+    dcpu_log(L_ERROR, "error writing capture '%s': %s\n", name, strerror(errno));
+    return;
+  }
+  if (cap.png) {
+    write_png(f);
+  } else {
+    fprintf(f, "P6\n%d %d\n255\n", LEM_WIDTH, LEM_HEIGHT);
+    fwrite(cap.rgb, 1, sizeof(cap.rgb), f);
+  }
+  fclose(f);
+}
+
+static void capture_tick(dcpu *dcpu, device *dev, tstamp_t now) {
+  (void)dev;
+  (void)now;
+  uint64_t cycles = dcpu->cycles;
+  if (cap.nextat < cap.nat && cycles >= cap.at[cap.nextat]) {
+    rasterize(dcpu);
+    write_frame(cycles);
+    while (cap.nextat < cap.nat && cycles >= cap.at[cap.nextat])
+      cap.nextat++;
+  }
+  if (cap.stream && cycles >= cap.nextframe) {
+    rasterize(dcpu);
+    if (fwrite(cap.rgb, 1, sizeof(cap.rgb), cap.stream) != sizeof(cap.rgb)) {
+      dcpu_log(L_ERROR, "error writing frame stream: %s\n", strerror(errno));
+      fclose(cap.stream);
+      cap.stream = NULL;
+    }
+    cap.nextframe += cap.framecycles;
+  }
+}
+
+static int compare_cycles(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// cycles is a comma-separated list of cycle counts at which to write single
+// frames. stream is a file (or fifo) to receive raw rgb24 frames at
+// DISPLAY_HZ. either may be NULL.
+bool dcpu_initcapture(dcpu *dcpu, uint32_t khz, const char *cycles,
+    const char *prefix, bool png, const char *stream) {
+  cap.regs = (lem_regs) { 0, 0, 0, 0 };
+  cap.hz = (uint64_t)khz * 1000;
+  cap.at = NULL;
+  cap.nat = 0;
+  cap.nextat = 0;
+  cap.prefix = prefix;
+  cap.png = png;
+  cap.stream = NULL;
+  cap.framecycles = cap.hz / DISPLAY_HZ;
+  cap.nextframe = 0;
+
+  lem_initfont();
+
+  for (const char *p = cycles; p && *p; ) {
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(p, &end, 10);
+    if (end == p || errno || (*end && *end != ',')) {
+      dcpu_exitmsg("--capture requires a comma-separated list of cycles\n");
+      return false;
+    }
+    cap.at = realloc(cap.at, (cap.nat + 1) * sizeof(*cap.at));
+    cap.at[cap.nat++] = n;
+    p = *end ? end + 1 : end;
+  }
+  qsort(cap.at, cap.nat, sizeof(*cap.at), compare_cycles);
+
+  if (stream) {
+    cap.stream = fopen(stream, "wb");
+    if (!cap.stream) {
+      dcpu_exitmsg("error opening stream '%s': %s\n", stream, strerror(errno));
+      return false;
+    }
+  }
+
+  // set up hardware descriptors
+  device *lem = dcpu_addhw(dcpu);
+  lem->id = 0x7349f615;
+  lem->version = 0x1802;
+  lem->mfr = 0x1c6c8b36;
+  lem->hwi = &capture_hwi;
+  lem->tick = &capture_tick;
+  lem->on_debug = NULL;
+  lem->save = &capture_save;
+  lem->restore = &capture_restore;
+  return true;
+}
+
+u16 dcpu_killcapture(void) {
+  if (cap.stream) fclose(cap.stream);
+  cap.stream = NULL;
+  free(cap.at);
+  cap.at = NULL;
+  cap.nat = 0;
+  return cap.regs.vram;
+}
@@ -32,6 +32,7 @@
 struct clock_t {
   tstamp_t tickns;
   tstamp_t nexttick;
+  u16 rate;
   u16 msg;
   u16 ticks;
 };
@@ -39,6 +40,7 @@ struct clock_t {
 static struct clock_t clock;
 
 static void set_rate(u16 rate) {
+  clock.rate = rate;
   // TODO can the clock tick at < 1hz, say once every two seconds? the spec is totally unclear.
   if (rate == 0) {
     // disable clock
@@ -52,7 +54,8 @@ static void set_rate(u16 rate) {
   clock.ticks = 0;
 }
 
-static u16 clock_hwi(dcpu *dcpu) {
+static u16 clock_hwi(dcpu *dcpu, device *dev) {
+  (void)dev;
   switch (dcpu->reg[REG_A]) {
     case 0:
       set_rate(dcpu->reg[REG_B]);
@@ -63,11 +66,18 @@ static u16 clock_hwi(dcpu *dcpu) {
     case 2:
       clock.msg = dcpu->reg[REG_B];
       break;
+    case 0x10:
+      // not in the spec: the low 32 bits of the cycles elapsed since boot,
+      // the high word in b. real clocks leave b and c alone.
+      dcpu->reg[REG_B] = dcpu->cycles >> 16;
+      dcpu->reg[REG_C] = dcpu->cycles;
+      break;
   }
   return 0; // no extra cycles
 }
 
-static void clock_tick(dcpu *dcpu, tstamp_t now) {
+static void clock_tick(dcpu *dcpu, device *dev, tstamp_t now) {
+  (void)dev;
   if (now > clock.nexttick) {
     clock.ticks++;
     if (clock.msg) dcpu_interrupt(dcpu, clock.msg);
@@ -75,6 +85,28 @@ static void clock_tick(dcpu *dcpu, tstamp_t now) {
   }
 }
 
+static size_t clock_save(dcpu *dcpu, device *dev, void *buf, size_t len) {
+  (void)dcpu; (void)dev;
+  uint8_t *p = buf;
+  if (len >= 6) {
+    p[0] = clock.rate >> 8;  p[1] = clock.rate;
+    p[2] = clock.msg >> 8;   p[3] = clock.msg;
+    p[4] = clock.ticks >> 8; p[5] = clock.ticks;
+  }
+  return 6;
+}
+
+static bool clock_restore(dcpu *dcpu, device *dev, const void *buf,
+    size_t len) {
+  (void)dcpu; (void)dev;
+  const uint8_t *p = buf;
+  if (len != 6) return false;
+  set_rate((p[0] << 8) | p[1]);
+  clock.msg = (p[2] << 8) | p[3];
+  clock.ticks = (p[4] << 8) | p[5];
+  return true;
+}
+
 void dcpu_initclock(dcpu *dcpu) {
   // it's unspecified what state the clock is in prior to the first hwi. we'll
   // just have it turned off.
@@ -88,5 +120,6 @@ void dcpu_initclock(dcpu *dcpu) {
   dev->mfr = 0x01220423;
   dev->hwi = &clock_hwi;
   dev->tick = &clock_tick;
-  dev->on_debug = NULL;
+  dev->save = &clock_save;
+  dev->restore = &clock_restore;
 }
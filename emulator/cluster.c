@@ -0,0 +1,350 @@
+/*
+ * Copyright (c) 2012, Matt Hellige
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above copyright notice, 
+ *   this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above copyright 
+ *   notice, this list of conditions and the following disclaimer in the 
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR 
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT 
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, 
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY 
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dcpu.h"
+
+// a cluster of cpus in one process. cpu 0 is the usual one, with the
+// terminal, debugger and so on; the rest each run the same image on their own
+// thread, with no devices but the mailbox. every cpu gets a mailbox, through
+// which they send each other single-word messages.
+//
+// each (sender, receiver) pair has its own single-producer, single-consumer
+// queue, so sending and receiving never take a lock. a receiver notices new
+// mail from its own thread, in its tick hook, and raises its interrupt there,
+// since dcpu_interrupt() is only safe to call from the cpu's own thread.
+//
+// cpus otherwise run freely, so which messages a receiver has seen at any
+// given cycle depends on host scheduling. in lockstep mode the cpus instead
+// meet at a barrier every quantum of emulated cycles. messages only become
+// visible to their receiver at the barrier after they were sent, and the room
+// a receiver frees only becomes visible to the sender at the barrier after
+// that, which makes the whole cluster deterministic (at the cost of running
+// at the pace of the slowest host thread). the debugger only knows about cpu 0, and in lockstep
+// mode the others wait for it while it's stopped.
+//
+// interrupts:
+//
+//   A=0: set B to this cpu's number and C to the number of cpus.
+//   A=1: set the interrupt message to X (0 disables interrupts). the
+//        interrupt is raised when new mail has arrived, at most once a
+//        cycle, so drain the mailbox in the handler.
+//   A=2: send Y to cpu X. sets B to 1 if it was sent, or 0 if cpu X doesn't
+//        exist or its queue from this cpu is full.
+//   A=3: receive. sets B to the sender and C to the message, or B to 0xffff
+//        if there's no mail.
+
+#define MAILQ_SIZE 64 // per pair of cpus; a power of two
+
+struct mailq_t {
+  u16 msgs[MAILQ_SIZE];
+  unsigned write; // only written by the sender
+  unsigned read;  // only written by the receiver
+  unsigned visible; // receiver's view of write, in lockstep mode
+  unsigned consumed; // sender's view of read, in lockstep mode
+  // write and read as of the last barrier, taken under the lock
+  unsigned wsnap, rsnap;
+};
+
+struct mailbox_t {
+  int id;
+  u16 msg;
+  unsigned next; // sender to look at first, for fairness
+  unsigned arrived; // count of sends to this cpu, bumped by any sender
+  unsigned seen;
+};
+
+struct cpu_t {
+  dcpu *dcpu;
+  struct mailbox_t box;
+  pthread_t thread;
+};
+
+static struct {
+  int n;
+  bool cow;
+  struct cpu_t *cpus;
+  struct mailq_t *queues; // n*n, indexed [from * n + to]
+
+  // lockstep barrier. count is the number of cpus still running.
+  uint64_t quantum; // 0 if running freely
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int count;
+  int waiting;
+  unsigned generation;
+  bool quit;
+
+  // how much each cpu's ram diverged from the shared image, kept from
+  // dcpu_killcluster() until the terminal's gone and it can be seen
+  unsigned nstats;
+  unsigned *own, *total;
+} cluster = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static struct mailq_t *queue(int from, int to) {
+  return &cluster.queues[from * cluster.n + to];
+}
+
+// wake everyone up if the last cpu has arrived. call holding the lock.
+// every cpu still running is waiting, so no more sends can happen until
+// they're woken, and what's been written by now is exactly what was sent
+// during this quantum.
+static void release(void) {
+  if (cluster.waiting && cluster.waiting >= cluster.count) {
+    for (int i = 0; i < cluster.n * cluster.n; i++) {
+      struct mailq_t *q = &cluster.queues[i];
+      q->wsnap = __atomic_load_n(&q->write, __ATOMIC_ACQUIRE);
+      q->rsnap = __atomic_load_n(&q->read, __ATOMIC_ACQUIRE);
+    }
+    cluster.waiting = 0;
+    cluster.generation++;
+    pthread_cond_broadcast(&cluster.cond);
+  }
+}
+
+// wait for the rest of the cluster to reach the end of this quantum, then
+// make everything sent during it visible.
+static void barrier(int id) {
+  pthread_mutex_lock(&cluster.lock);
+  unsigned gen = cluster.generation;
+  cluster.waiting++;
+  release();
+  while (gen == cluster.generation && !cluster.quit)
+    pthread_cond_wait(&cluster.cond, &cluster.lock);
+
+  // not write and read themselves: by now, cpus that left the barrier
+  // first may be sending and receiving again, in the following quantum
+  for (int other = 0; other < cluster.n; other++) {
+    queue(other, id)->visible = queue(other, id)->wsnap;
+    queue(id, other)->consumed = queue(id, other)->rsnap;
+  }
+  pthread_mutex_unlock(&cluster.lock);
+}
+
+// stop taking part in the barrier, so a halted cpu doesn't hold up the rest
+static void leave(void) {
+  pthread_mutex_lock(&cluster.lock);
+  cluster.count--;
+  release();
+  pthread_mutex_unlock(&cluster.lock);
+}
+
+static unsigned visible(struct mailq_t *q) {
+  if (cluster.quantum) return q->visible;
+  return __atomic_load_n(&q->write, __ATOMIC_ACQUIRE);
+}
+
+// likewise, in lockstep mode, a sender only sees room freed up by the
+// receiver as of the last barrier
+static unsigned consumed(struct mailq_t *q) {
+  if (cluster.quantum) return q->consumed;
+  return __atomic_load_n(&q->read, __ATOMIC_ACQUIRE);
+}
+
+static void send(dcpu *dcpu, struct mailbox_t *box) {
+  u16 to = dcpu->reg[REG_X];
+  dcpu->reg[REG_B] = 0;
+  if (to >= cluster.n) return;
+  struct mailq_t *q = queue(box->id, to);
+  unsigned write = q->write;
+  if (write - consumed(q) == MAILQ_SIZE) return;
+  q->msgs[write % MAILQ_SIZE] = dcpu->reg[REG_Y];
+  __atomic_store_n(&q->write, write + 1, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&cluster.cpus[to].box.arrived, 1, __ATOMIC_RELEASE);
+  dcpu->reg[REG_B] = 1;
+}
+
+static void receive(dcpu *dcpu, struct mailbox_t *box) {
+  dcpu->reg[REG_B] = 0xffff;
+  for (int i = 0; i < cluster.n; i++) {
+    unsigned from = (box->next + i) % cluster.n;
+    struct mailq_t *q = queue(from, box->id);
+    if (q->read != visible(q)) {
+      dcpu->reg[REG_B] = from;
+      dcpu->reg[REG_C] = q->msgs[q->read % MAILQ_SIZE];
+      __atomic_store_n(&q->read, q->read + 1, __ATOMIC_RELEASE);
+      box->next = from + 1;
+      return;
+    }
+  }
+}
+
+static u16 mailbox_hwi(dcpu *dcpu, device *dev) {
+  struct mailbox_t *box = dev->ctx;
+  switch (dcpu->reg[REG_A]) {
+    case 0: // identify
+      dcpu->reg[REG_B] = box->id;
+      dcpu->reg[REG_C] = cluster.n;
+      break;
+    case 1: // set interrupt
+      box->msg = dcpu->reg[REG_X];
+      break;
+    case 2:
+      send(dcpu, box);
+      break;
+    case 3:
+      receive(dcpu, box);
+      break;
+  }
+  return 0;
+}
+
+// mail that arrives while interrupts are off is still news once they're on
+static void notify(dcpu *dcpu, struct mailbox_t *box, unsigned arrived) {
+  if (arrived == box->seen || !box->msg) return;
+  dcpu_interrupt(dcpu, box->msg);
+  box->seen = arrived;
+}
+
+static void mailbox_tick(dcpu *dcpu, device *dev, tstamp_t now) {
+  (void)now;
+  struct mailbox_t *box = dev->ctx;
+  if (cluster.quantum) {
+    if (dcpu->cycles % cluster.quantum) return;
+    barrier(box->id);
+    // a message is only visible once it's past a barrier, so that's when
+    // to count it as arrived.
+    unsigned arrived = 0;
+    for (int from = 0; from < cluster.n; from++)
+      arrived += queue(from, box->id)->visible;
+    notify(dcpu, box, arrived);
+    return;
+  }
+  notify(dcpu, box, __atomic_load_n(&box->arrived, __ATOMIC_ACQUIRE));
+}
+
+static void *cpu_thread(void *arg) {
+  struct cpu_t *cpu = arg;
+  dcpu *dcpu = cpu->dcpu;
+  dcpu->nexttick = dcpu_now() + dcpu->tickns;
+  while (!dcpu_die && !__atomic_load_n(&cluster.quit, __ATOMIC_ACQUIRE)) {
+    action_t action = dcpu_step(dcpu);
+    if (action != A_CONTINUE) {
+      dcpu_log(L_WARN, "cpu %d halted at 0x%04x.\n", cpu->box.id, dcpu->pc);
+      break;
+    }
+  }
+  if (cluster.quantum) leave();
+  return NULL;
+}
+
+static device *add_mailbox(struct cpu_t *cpu) {
+  device *dev = dcpu_addhw(cpu->dcpu);
+  dev->id = 0x6d61696c; // "mail"
+  dev->version = 0x0001;
+  dev->mfr = 0; // not a real device
+  dev->hwi = &mailbox_hwi;
+  dev->tick = &mailbox_tick;
+  dev->ctx = &cpu->box;
+  return dev;
+}
+
+// set up n-1 more cpus running the same image as dcpu, and start them. with a
+// nonzero quantum, run in lockstep. if base isn't -1, their ram is mapped
+// copy-on-write from it (see dcpu_cowbase()), rather than loaded from image.
+bool dcpu_initcluster(dcpu *dcpu, int n, uint32_t khz, const char *image,
+    bool bigend, int base, uint64_t quantum) {
+  cluster.n = n;
+  cluster.cow = base >= 0;
+  cluster.cpus = calloc(n, sizeof(struct cpu_t));
+  cluster.queues = calloc(n * n, sizeof(struct mailq_t));
+  cluster.quantum = quantum;
+  cluster.count = n;
+
+  for (int i = 0; i < n; i++) {
+    struct cpu_t *cpu = &cluster.cpus[i];
+    cpu->box.id = i;
+    if (i) {
+      cpu->dcpu = malloc(sizeof(*cpu->dcpu));
+      dcpu_init(cpu->dcpu, khz);
+      cpu->dcpu->detect_loops = false;
+      if (base >= 0 ? !dcpu_mapram(cpu->dcpu, base)
+          : !dcpu_loadcore(cpu->dcpu, image, bigend))
+        return false;
+    } else {
+      cpu->dcpu = dcpu;
+    }
+    add_mailbox(cpu);
+  }
+
+  for (int i = 1; i < n; i++) {
+    if (pthread_create(&cluster.cpus[i].thread, NULL, &cpu_thread,
+          &cluster.cpus[i])) {
+      dcpu_exitmsg("couldn't start cpu %d\n", i);
+      return false;
+    }
+  }
+  return true;
+}
+
+// cpu 0 is done. stop the rest and tear them down.
+void dcpu_killcluster(void) {
+  if (!cluster.n) return;
+  pthread_mutex_lock(&cluster.lock);
+  __atomic_store_n(&cluster.quit, true, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&cluster.cond);
+  pthread_mutex_unlock(&cluster.lock);
+
+  for (int i = 1; i < cluster.n; i++)
+    pthread_join(cluster.cpus[i].thread, NULL);
+
+  if (cluster.cow) {
+    cluster.own = calloc(cluster.n, sizeof(unsigned));
+    cluster.total = calloc(cluster.n, sizeof(unsigned));
+    cluster.nstats = cluster.n;
+    for (int i = 0; i < cluster.n; i++)
+      if (!dcpu_ramstats(cluster.cpus[i].dcpu, &cluster.own[i],
+            &cluster.total[i]))
+        cluster.total[i] = 0;
+  }
+
+  for (int i = 1; i < cluster.n; i++) {
+    dcpu_killhw(cluster.cpus[i].dcpu);
+    dcpu_killram(cluster.cpus[i].dcpu);
+    free(cluster.cpus[i].dcpu);
+  }
+  free(cluster.queues);
+  free(cluster.cpus);
+  cluster.n = 0;
+}
+
+// print the ram stats noted by dcpu_killcluster(), if any
+void dcpu_clusterstats(void) {
+  for (unsigned i = 0; i < cluster.nstats; i++)
+    if (cluster.total[i])
+      printf(" * cpu %u: %u of %u pages of ram written\n", i, cluster.own[i],
+          cluster.total[i]);
+  free(cluster.own);
+  free(cluster.total);
+  cluster.nstats = 0;
+}
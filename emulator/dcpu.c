@@ -42,14 +42,35 @@
 #endif
 
 #include "dcpu.h"
+#include "lem.h"
 #include "opcodes.h"
 
 volatile bool dcpu_break = false;
 volatile bool dcpu_die = false;
 static struct termios old_termios;
 
+// long-only options
+enum {
+  OPT_PREFIX = 0x100,
+  OPT_PNG,
+  OPT_STREAM,
+  OPT_LOG,
+  OPT_LOGLEVEL,
+  OPT_DEVICE,
+  OPT_CPUS,
+  OPT_LOCKSTEP,
+  OPT_COW,
+  OPT_BATCH,
+  OPT_BATCHCYCLES,
+  OPT_BATCHSCALAR,
+  OPT_FUZZ,
+  OPT_FUZZCYCLES,
+};
+
 static void usage(char **argv) {
   fprintf(stderr, "usage: %s [options] <image>\n", argv[0]);
+  fprintf(stderr, "       %s --fuzz[=c] [options] <image> [inputs...]\n",
+      argv[0]);
   fprintf(stderr, "   -h, --help           display this message\n");
   fprintf(stderr, "   -v, --version        display the version and exit\n");
   fprintf(stderr, "   -g, --graphics       enable graphical display window\n");
@@ -57,9 +78,40 @@ static void usage(char **argv) {
   fprintf(stderr, "   -e, --little-endian  image file is little-endian\n");
   fprintf(stderr, "   -d, --debug-boot     enter debugger on boot\n");
   fprintf(stderr, "   -l, --detect-loops   "
-      "enter debugger on single-instruction loop\n");
+      "enter debugger on single-instruction loop, unless\n"
+      "                        it's waiting for an interrupt\n");
   fprintf(stderr, "   -s, --dump-screen    "
       "dump (ascii) contents of video ram to stdout on exit\n");
+  fprintf(stderr, "   -C, --capture=c,...  "
+      "capture the display at the given cycle counts\n");
+  fprintf(stderr, "   --capture-prefix=p   "
+      "name captures p<cycles>.ppm (default \"frame-\")\n");
+  fprintf(stderr, "   --png                write captures as png, not ppm\n");
+  fprintf(stderr, "   --stream=path        "
+      "stream raw rgb24 display frames to path\n");
+  fprintf(stderr, "   --device=lib[:args]  "
+      "attach a device from a shared object (repeatable)\n");
+  fprintf(stderr, "   --cpus=n             "
+      "run n cpus with the same image, linked by mailboxes\n");
+  fprintf(stderr, "   --lockstep=q         "
+      "synchronize the cpus every q cycles, for determinism\n");
+  fprintf(stderr, "   --cow[=cache]        "
+      "map ram copy-on-write from a shared copy of the image\n");
+  fprintf(stderr, "   --batch=n            "
+      "run n headless copies of the image, and print their registers\n");
+  fprintf(stderr, "   --batch-cycles=c     "
+      "stop each copy after c cycles (default 1000000)\n");
+  fprintf(stderr, "   --batch-scalar       "
+      "don't run batch copies in lockstep, for comparison\n");
+  fprintf(stderr, "   --fuzz[=c]           "
+      "boot to cycle c (or the first key read), then run each\n"
+      "                        input as typed keys from there\n");
+  fprintf(stderr, "   --fuzz-cycles=c      "
+      "stop each fuzzing run after c cycles (default 1000000)\n");
+  fprintf(stderr, "   --log=path           "
+      "write emulator messages to path (- for stderr)\n");
+  fprintf(stderr, "   --log-level=level    "
+      "debug, info, warn or error (default info)\n");
   fprintf(stderr, "\n");
   fprintf(stderr,
       "the maximum achievable clock rate depends on the host cpu as well\n");
@@ -69,6 +121,12 @@ static void usage(char **argv) {
   fprintf(stderr,
       "the -e option controls the endianness of the input image only. core\n");
   fprintf(stderr, "dump files are *always* big-endian.\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr,
+      "capturing or streaming replaces the interactive display with a\n");
+  fprintf(stderr,
+      "headless one. streamed frames are %dx%d, at %dHz of emulated time.\n",
+      LEM_WIDTH, LEM_HEIGHT, DISPLAY_HZ);
 } 
 
 static void int_handler(int signum) {
@@ -110,6 +168,23 @@ int main(int argc, char **argv) {
   bool debug = false;
   bool dump_screen = false;
   bool graphics = false;
+  const char *capture = NULL;
+  const char *prefix = "frame-";
+  bool png = false;
+  const char *stream = NULL;
+  const char *logpath = NULL;
+  loglevel_t loglevel = L_INFO;
+  const char **devices = calloc(argc, sizeof(char *));
+  int ndevices = 0;
+  int ncpus = 1;
+  uint64_t quantum = 0;
+  bool cow = false;
+  int batch = 0;
+  uint64_t batchcycles = 1000000;
+  bool batchvector = true;
+  bool fuzz = false;
+  uint64_t fuzzat = 0, fuzzcycles = 1000000;
+  const char *cowcache = NULL;
   dcpu dcpu;
   dcpu.detect_loops = false;
 
@@ -125,10 +200,25 @@ int main(int argc, char **argv) {
       {"little-endian", 0, 0, 'e'},
       {"detect-loops", 0, 0, 'l'},
       {"dump-screen", 0, 0, 's'},
+      {"capture", 1, 0, 'C'},
+      {"capture-prefix", 1, 0, OPT_PREFIX},
+      {"png", 0, 0, OPT_PNG},
+      {"stream", 1, 0, OPT_STREAM},
+      {"log", 1, 0, OPT_LOG},
+      {"log-level", 1, 0, OPT_LOGLEVEL},
+      {"device", 1, 0, OPT_DEVICE},
+      {"cpus", 1, 0, OPT_CPUS},
+      {"lockstep", 1, 0, OPT_LOCKSTEP},
+      {"cow", 2, 0, OPT_COW},
+      {"batch", 1, 0, OPT_BATCH},
+      {"batch-cycles", 1, 0, OPT_BATCHCYCLES},
+      {"batch-scalar", 0, 0, OPT_BATCHSCALAR},
+      {"fuzz", 2, 0, OPT_FUZZ},
+      {"fuzz-cycles", 1, 0, OPT_FUZZCYCLES},
       {0, 0, 0, 0},
     };
 
-    c = getopt_long(argc, argv, "hvgk:dels", long_options, NULL);
+    c = getopt_long(argc, argv, "hvgk:delsC:", long_options, NULL);
 
     if (c == -1) break;
 
@@ -169,27 +259,165 @@ int main(int argc, char **argv) {
       case 's':
         dump_screen = true;
         break;
+      case 'C':
+        capture = optarg;
+        break;
+      case OPT_PREFIX:
+        prefix = optarg;
+        break;
+      case OPT_PNG:
+        png = true;
+        break;
+      case OPT_STREAM:
+        stream = optarg;
+        break;
+      case OPT_LOG:
+        logpath = optarg;
+        break;
+      case OPT_DEVICE:
+        devices[ndevices++] = optarg;
+        break;
+      case OPT_CPUS: {
+        char *endptr;
+        ncpus = strtol(optarg, &endptr, 10);
+        if (*endptr || ncpus < 1 || ncpus > 0x100) {
+          fprintf(stderr, "--cpus requires a count from 1 to 256\n");
+          return 1;
+        }
+        break;
+      }
+      case OPT_LOCKSTEP: {
+        char *endptr;
+        quantum = strtoull(optarg, &endptr, 10);
+        if (*endptr || !quantum) {
+          fprintf(stderr, "--lockstep requires a positive cycle count\n");
+          return 1;
+        }
+        break;
+      }
+      case OPT_COW:
+        cow = true;
+        cowcache = optarg;
+        break;
+      case OPT_BATCH: {
+        char *endptr;
+        batch = strtol(optarg, &endptr, 10);
+        if (*endptr || batch < 1) {
+          fprintf(stderr, "--batch requires a positive count\n");
+          return 1;
+        }
+        break;
+      }
+      case OPT_BATCHCYCLES: {
+        char *endptr;
+        batchcycles = strtoull(optarg, &endptr, 10);
+        if (*endptr || !batchcycles) {
+          fprintf(stderr, "--batch-cycles requires a positive count\n");
+          return 1;
+        }
+        break;
+      }
+      case OPT_BATCHSCALAR:
+        batchvector = false;
+        break;
+      case OPT_FUZZ:
+        fuzz = true;
+        if (optarg) {
+          char *endptr;
+          fuzzat = strtoull(optarg, &endptr, 10);
+          if (*endptr) {
+            fprintf(stderr, "--fuzz takes a cycle count\n");
+            return 1;
+          }
+        }
+        break;
+      case OPT_FUZZCYCLES: {
+        char *endptr;
+        fuzzcycles = strtoull(optarg, &endptr, 10);
+        if (*endptr || !fuzzcycles) {
+          fprintf(stderr, "--fuzz-cycles requires a positive count\n");
+          return 1;
+        }
+        break;
+      }
+      case OPT_LOGLEVEL:
+        if (!dcpu_parseloglevel(optarg, &loglevel)) {
+          fprintf(stderr, "unknown log level '%s'\n", optarg);
+          return 1;
+        }
+        break;
       default:
         usage(argv);
         return 1;
     }
   }
 
-  if (argc - optind != 1) {
+  if (argc - optind != 1 && !(fuzz && argc > optind)) {
     usage(argv);
     return 1;
   }
   
   const char *image = argv[optind];
+  bool headless = capture || stream;
+  if (headless && graphics) {
+    fprintf(stderr, "can't capture the display with graphics enabled\n");
+    return 1;
+  }
+
+  // nor does fuzzing. guests' complaints about bad input are just noise.
+  if (fuzz) {
+    dcpu_initops();
+    if (!dcpu_initlog(logpath ? logpath : "-",
+          loglevel > L_WARN ? loglevel : L_WARN)
+        || !dcpu_fuzzinit(image, bigend, fuzzat, fuzzcycles))
+      return 1;
+    int res = dcpu_fuzzmain(argc - optind - 1, argv + optind + 1);
+    dcpu_killlog();
+    return res;
+  }
+
+  // batch mode has no terminal, devices or debugger: just the cpus
+  if (batch) {
+    dcpu_initops();
+    if (!dcpu_initlog(logpath ? logpath : "-", loglevel)) return 1;
+    int base = dcpu_cowbase(image, bigend, cowcache);
+    if (base < 0) return 1;
+    dcpu_runbatch(batch, base, batchcycles, batchvector);
+    dcpu_killlog();
+    return 0;
+  }
 
   // init term first so that image load status is visible...
   block_signals();
   dcpu_initops();
   dcpu_init(&dcpu, khz);
-  dcpu_initterm(&dcpu, !graphics);
+  dcpu_initterm(&dcpu, !graphics && !headless);
+  if (!dcpu_initlog(logpath, loglevel)) {
+    tcsetattr(0, TCSANOW, &old_termios);
+    return 1;
+  }
+  if (headless
+      && !dcpu_initcapture(&dcpu, khz, capture, prefix, png, stream)) {
+    tcsetattr(0, TCSANOW, &old_termios);
+    return 1;
+  }
   dcpu_initclock(&dcpu);
   if (graphics) dcpu_initlem(&dcpu);
-  if (!dcpu_loadcore(&dcpu, image, bigend)) {
+  for (int i = 0; i < ndevices; i++) {
+    if (!dcpu_loaddevice(&dcpu, devices[i])) {
+      tcsetattr(0, TCSANOW, &old_termios);
+      return 1;
+    }
+  }
+  free(devices);
+  int base = cow ? dcpu_cowbase(image, bigend, cowcache) : -1;
+  if (cow ? base < 0 || !dcpu_mapram(&dcpu, base)
+      : !dcpu_loadcore(&dcpu, image, bigend)) {
+    tcsetattr(0, TCSANOW, &old_termios);
+    return -1;
+  }
+  if ((ncpus > 1 || quantum)
+      && !dcpu_initcluster(&dcpu, ncpus, khz, image, bigend, base, quantum)) {
     tcsetattr(0, TCSANOW, &old_termios);
     return -1;
   }
@@ -201,9 +429,14 @@ int main(int argc, char **argv) {
   dcpu_msg("press ctrl-c or send SIGINT for debugger, ctrl-d to exit.\n");
   dcpu_run(&dcpu, debug);
 
+  dcpu_killcluster();
+  dcpu_killhw(&dcpu);
+  dcpu_killlog();
   u16 vram = dcpu_killterm();
   if (graphics) vram = dcpu_killlem();
+  if (headless) vram = dcpu_killcapture();
   puts(" * dcpu-16 halted.");
+  dcpu_clusterstats();
 
   if (dump_screen) {
     if (vram) {
@@ -36,8 +36,9 @@ typedef uint16_t u16;
 typedef uint64_t tstamp_t;
 
 #define DCPU_VERSION  "1.7-mh"
-#define DCPU_MODS     "+img +die +dbg"
+#define DCPU_MODS     "+img +die +dbg +clock-cycles"
 #define COREFILE_NAME "core.img"
+#define STATEFILE_NAME "state.img"
 #define DEFAULT_KHZ   150
 
 #define RAM_WORDS 0x10000
@@ -48,6 +49,7 @@ typedef uint64_t tstamp_t;
 #define REG_C     2
 #define REG_X     3
 #define REG_Y     4
+#define REG_Z     5
 #define REG_I     6
 #define REG_J     7
 #define OP_MASK   0x1f
@@ -57,38 +59,66 @@ typedef uint64_t tstamp_t;
 #define ARGB_SIZE 5
 // one extra slot in the interrupt queue for overflow detection
 #define INTQ_SIZE 257
-#define HW_SIZE   8
+// the most devices hwn can report
+#define HW_MAX    0xffff
+
+// writes to ram are tracked in pages of 1 << DIRTY_SHIFT words. every write
+// sets all the bits of its page's entry in the dirty map, and each consumer
+// owns one bit, which it clears once it's caught up.
+#define DIRTY_SHIFT 5
+#define DIRTY_PAGES (RAM_WORDS >> DIRTY_SHIFT)
+#define DIRTY_VIDEO 0x01
+#define DIRTY_FUZZ  0x02
 
 #define DISPLAY_HZ    30
 #define BLINK_HZ      2
 #define SCR_HEIGHT    12
 #define SCR_WIDTH     32
 #define SCR_BORDER    8
-#define KBD_BAUD      100000
 #define CLOCKDEV_HZ   60
 #define SCR_SCALE     2
 
 struct dcpu_t;
 
+// the device abi. plugins (see plugin.c) are built against this header, and
+// must export an int dcpu_device_abi equal to DCPU_DEVICE_ABI. bump this
+// whenever struct device_t or struct dcpu_t changes incompatibly.
+#define DCPU_DEVICE_ABI 3
+
 typedef struct device_t {
   uint32_t id;
   uint32_t mfr;
   u16 version;
-  u16 (*hwi)(struct dcpu_t *);
-  void (*tick)(struct dcpu_t *, tstamp_t);
-  void (*on_debug)(struct dcpu_t *);
+  // returns the number of extra cycles taken
+  u16 (*hwi)(struct dcpu_t *, struct device_t *);
+  // called every cycle. may be NULL
+  void (*tick)(struct dcpu_t *, struct device_t *, tstamp_t);
+  // called before entering the debugger. may be NULL
+  void (*on_debug)(struct dcpu_t *, struct device_t *);
+  // serialize state into buf, if len is big enough, and return the size
+  // needed. buf may be NULL. may be NULL for stateless devices
+  size_t (*save)(struct dcpu_t *, struct device_t *, void *buf, size_t len);
+  bool (*restore)(struct dcpu_t *, struct device_t *, const void *buf,
+      size_t len);
+  // called at exit. may be NULL
+  void (*kill)(struct dcpu_t *, struct device_t *);
+  // for the device's own use
+  void *ctx;
 } device;
 
 typedef struct dcpu_t {
   bool detect_loops;
   int tickns;
   tstamp_t nexttick;
+  bool unpaced; // run flat out, without looking at the time at all
+  uint64_t cycles; // elapsed since boot
   u16 sp;
   u16 pc;
   u16 ex;
   u16 ia;
   u16 reg[NREGS];
-  u16 ram[RAM_WORDS];
+  u16 *ram; // RAM_WORDS, mapped by dcpu_init() or dcpu_mapram()
+  uint8_t dirty[DIRTY_PAGES];
 
   // interrupt queue
   bool qints;
@@ -96,9 +126,11 @@ typedef struct dcpu_t {
   u16 intqwrite;
   u16 intqread;
 
-  // hardware devices.
+  // hardware devices. the table may move as devices are added, so don't
+  // hold on to pointers into it.
   u16 nhw;
-  device hw[HW_SIZE];
+  u16 hwcap;
+  device *hw;
 } dcpu;
 
 typedef enum {
@@ -107,6 +139,14 @@ typedef enum {
   A_EXIT
 } action_t;
 
+typedef enum {
+  L_DEBUG,
+  L_INFO,
+  L_WARN,
+  L_ERROR,
+  L_NLEVELS
+} loglevel_t;
+
 
 static inline uint8_t get_opcode(u16 instr) {
   return instr & OP_MASK;
@@ -120,39 +160,115 @@ static inline uint8_t arg_a(u16 instr) {
   return (instr >> (OP_SIZE + ARGB_SIZE)) & ARGA_MASK;
 }
 
-static inline device *dcpu_addhw(dcpu *dcpu) {
-  return &dcpu->hw[dcpu->nhw++];
+static inline void dcpu_touch(dcpu *dcpu, u16 addr) {
+  dcpu->dirty[addr >> DIRTY_SHIFT] = 0xff;
+}
+
+// devices should write to ram through here, so the write is tracked
+static inline void dcpu_write(dcpu *dcpu, u16 addr, u16 val) {
+  dcpu->ram[addr] = val;
+  dcpu_touch(dcpu, addr);
 }
 
 // clock.c
 extern void dcpu_initclock(dcpu *dcpu);
 
 // disassembler.c
+// per-word flags computed by dcpu_flow()
+#define DIS_CODE  0x01  // start of a decoded instruction
+#define DIS_ARG   0x02  // operand word of a decoded instruction
+#define DIS_BLOCK 0x04  // start of a basic block
+#define DIS_JUMP  0x08  // target of a jump
+#define DIS_CALL  0x10  // target of a jsr
+#define DIS_INT   0x20  // interrupt handler (installed via ias)
+#define DIS_ENTRY 0x40  // entry point given to dcpu_flow()
+#define DIS_SKIP  0x80  // either outcome of a conditional
 extern u16 *dcpu_disassemble(u16 *pc, char *out);
+extern u16 dcpu_inslen(u16 instr);
+extern void dcpu_flow(const u16 *ram, const u16 *entries, int nentries,
+    uint8_t *flags);
+extern void dcpu_listing(const u16 *ram, const uint8_t *flags, u16 addr,
+    uint32_t len, void (*emit)(const char *));
+extern void dcpu_cfg(const u16 *ram, const uint8_t *flags,
+    void (*emit)(const char *));
 
 // emulator.c
 extern tstamp_t dcpu_now();
 extern void dcpu_init(dcpu *dcpu, uint32_t khz);
+extern device *dcpu_addhw(dcpu *dcpu);
+extern void dcpu_killhw(dcpu *dcpu);
+extern int dcpu_cowbase(const char *image, bool bigend, const char *cache);
+extern bool dcpu_mapram(dcpu *dcpu, int base);
+extern void dcpu_killram(dcpu *dcpu);
+extern bool dcpu_ramstats(dcpu *dcpu, unsigned *own, unsigned *total);
 bool dcpu_loadcore(dcpu *dcpu, const char *image, bool bigend);
 extern void dcpu_coredump(dcpu *dcpu, uint32_t limit);
 extern void dcpu_run(dcpu *dcpu, bool debugboot);
 extern action_t dcpu_step(dcpu *dcpu);
 extern void dcpu_interrupt(dcpu *dcpu, u16 interrupt);
 
+// batch.c
+extern void dcpu_runbatch(int n, int base, uint64_t budget, bool vector);
+
+// capture.c
+extern bool dcpu_initcapture(dcpu *dcpu, uint32_t khz, const char *cycles,
+    const char *prefix, bool png, const char *stream);
+extern u16 dcpu_killcapture(void);
+
+// cluster.c
+extern bool dcpu_initcluster(dcpu *dcpu, int n, uint32_t khz,
+    const char *image, bool bigend, int base, uint64_t quantum);
+extern void dcpu_killcluster(void);
+extern void dcpu_clusterstats(void);
+
 // debugger.c
 extern bool dcpu_debug(dcpu *dcpu);
 
+// floppy.c
+extern bool dcpu_initfloppy(dcpu *dcpu, const char *args);
+
+// fuzz.c
+extern bool dcpu_fuzzinit(const char *image, bool bigend, uint64_t at,
+    uint64_t budget);
+extern void dcpu_fuzzmap(uint8_t *map);
+extern void dcpu_fuzzone(const uint8_t *data, size_t len);
+extern unsigned dcpu_fuzzcoverage(void);
+extern int dcpu_fuzzmain(int ninputs, char **inputs);
+
+// log.c
+extern bool dcpu_initlog(const char *path, loglevel_t level);
+extern bool dcpu_parseloglevel(const char *name, loglevel_t *level);
+extern void dcpu_log(loglevel_t level, char *fmt, ...)
+  __attribute__ ((format (printf, 2, 3)));
+extern void dcpu_msg(char *fmt, ...)
+  __attribute__ ((format (printf, 1, 2)));
+extern void dcpu_logsync(bool sync);
+extern void dcpu_flushlog(void);
+extern void dcpu_killlog(void);
+
+// memops.c
+extern bool dcpu_initmemops(dcpu *dcpu, const char *args);
+
 // opcodes.c
 extern void dcpu_initops(void);
 
+// pipe.c
+extern bool dcpu_initpipe(dcpu *dcpu, const char *args);
+
+// plugin.c
+extern bool dcpu_loaddevice(dcpu *dcpu, const char *spec);
+
 // sdl_lem.c
 extern void dcpu_initlem(dcpu *dcpu);
 extern u16 dcpu_killlem(void);
 
+// state.c
+extern bool dcpu_savestate(dcpu *dcpu, const char *path);
+extern bool dcpu_loadstate(dcpu *dcpu, const char *path);
+
 // terminal.c
 extern void dcpu_initterm(dcpu *dcpu, bool display);
-extern void dcpu_msg(char *fmt, ...)
-  __attribute__ ((format (printf, 1, 2)));
+extern void dcpu_termwrite(const char **lines, int n);
 extern int dcpu_getch(void);
 extern int dcpu_getstr(char *buf, int n);
 extern void dcpu_runterm(void);
@@ -0,0 +1,170 @@
+/*
+ * Copyright (c) 2012, Matt Hellige
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above copyright notice, 
+ *   this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above copyright 
+ *   notice, this list of conditions and the following disclaimer in the 
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR 
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT 
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, 
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY 
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// a standalone disassembler. it performs the same control flow analysis as
+// the debugger's 'list' command over a whole image, and can also write out
+// the recovered control flow graph for use by other tools.
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dcpu.h"
+
+#define MAX_ENTRIES 256
+
+static u16 ram[RAM_WORDS];
+static uint8_t flags[RAM_WORDS];
+
+static void usage(char **argv) {
+  fprintf(stderr, "usage: %s [options] <image>\n", argv[0]);
+  fprintf(stderr, "   -h, --help           display this message\n");
+  fprintf(stderr, "   -e, --little-endian  image file is little-endian\n");
+  fprintf(stderr, "   -s, --start=addr     start listing at addr (hex)\n");
+  fprintf(stderr, "   -n, --length=len     list len words (hex)\n");
+  fprintf(stderr, "   -E, --entry=addr     "
+      "additional entry point for flow analysis (hex)\n");
+  fprintf(stderr, "   -g, --cfg            "
+      "write the control flow graph rather than a listing\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr,
+      "address 0 is always an entry point. by default the whole image is\n");
+  fprintf(stderr, "listed. the control flow graph is written one basic block "
+      "per line:\n");
+  fprintf(stderr, "    <start> <end> [kind:<target>]...\n");
+  fprintf(stderr, "where kind is one of jump, cond, call, int or fall.\n");
+}
+
+static bool hexarg(const char *arg, const char *name, uint32_t max,
+    uint32_t *val) {
+  char *endptr;
+  *val = strtoul(arg, &endptr, 16);
+  if (*endptr || !*arg || *val > max) {
+    fprintf(stderr, "--%s requires a hex argument no larger than 0x%x\n",
+        name, max);
+    return false;
+  }
+  return true;
+}
+
+static void emitline(const char *line) {
+  fputs(line, stdout);
+  putchar('\n');
+}
+
+int main(int argc, char **argv) {
+  bool bigend = true;
+  bool cfg = false;
+  uint32_t start = 0;
+  uint32_t length = RAM_WORDS;
+  u16 entries[MAX_ENTRIES] = { 0 };
+  int nentries = 1;
+
+  for (;;) {
+    int c;
+    uint32_t val;
+
+    static struct option long_options[] = {
+      {"help", 0, 0, 'h'},
+      {"little-endian", 0, 0, 'e'},
+      {"start", 1, 0, 's'},
+      {"length", 1, 0, 'n'},
+      {"entry", 1, 0, 'E'},
+      {"cfg", 0, 0, 'g'},
+      {0, 0, 0, 0},
+    };
+
+    c = getopt_long(argc, argv, "hes:n:E:g", long_options, NULL);
+
+    if (c == -1) break;
+
+    switch (c) {
+      case 'h':
+        usage(argv);
+        return 0;
+      case 'e':
+        bigend = false;
+        break;
+      case 's':
+        if (!hexarg(optarg, "start", RAM_WORDS - 1, &start)) return 1;
+        break;
+      case 'n':
+        if (!hexarg(optarg, "length", RAM_WORDS, &length)) return 1;
+        break;
+      case 'E':
+        if (!hexarg(optarg, "entry", RAM_WORDS - 1, &val)) return 1;
+        if (nentries == MAX_ENTRIES) {
+          fprintf(stderr, "too many entry points\n");
+          return 1;
+        }
+        entries[nentries++] = val;
+        break;
+      case 'g':
+        cfg = true;
+        break;
+      default:
+        usage(argv);
+        return 1;
+    }
+  }
+
+  if (argc - optind != 1) {
+    usage(argv);
+    return 1;
+  }
+
+  const char *image = argv[optind];
+  FILE *img = fopen(image, "r");
+  if (!img) {
+    fprintf(stderr, "error reading image '%s': %s\n", image, strerror(errno));
+    return 1;
+  }
+  size_t img_size = fread(ram, 2, RAM_WORDS, img);
+  if (ferror(img)) {
+    fprintf(stderr, "error reading image '%s': %s\n", image, strerror(errno));
+    return 1;
+  }
+  fclose(img);
+
+  if (bigend)
+    for (int i = 0; i < RAM_WORDS; i++)
+      ram[i] = (ram[i] >> 8) | ((ram[i] & 0xff) << 8);
+
+  // by default, don't bother listing the zeros past the end of the image
+  if (length == RAM_WORDS && start == 0) length = img_size;
+
+  dcpu_initops();
+  dcpu_flow(ram, entries, nentries, flags);
+
+  static char buf[1 << 16];
+  setvbuf(stdout, buf, _IOFBF, sizeof(buf));
+  if (cfg) dcpu_cfg(ram, flags, emitline);
+  else dcpu_listing(ram, flags, start, length, emitline);
+  return 0;
+}
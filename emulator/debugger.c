@@ -54,6 +54,19 @@ static void dumpram(dcpu *dcpu, u16 addr, int len) {
   dcpu_msg("\n");
 }
 
+static void emitline(const char *line) {
+  dcpu_msg("%s\n", line);
+}
+
+static void listing(dcpu *dcpu, u16 addr, uint32_t len) {
+  static uint8_t flags[RAM_WORDS];
+  // flow analysis always covers all of ram, starting from everywhere we know
+  // code might be...
+  u16 entries[] = { 0, dcpu->pc, addr, dcpu->ia };
+  dcpu_flow(dcpu->ram, entries, dcpu->ia ? 4 : 3, flags);
+  dcpu_listing(dcpu->ram, flags, addr, len, emitline);
+}
+
 static void dumpheader(void) {
   dcpu_msg(
       "pc   sp   ex   ia   a    b    c    x    y    z    i    j    iaq "
@@ -95,7 +108,13 @@ bool dcpu_debug(dcpu *dcpu) {
           "  dump: display the state of the cpu\n"
           "  print addr [len]: display memory contents in hex\n"
           "      (addr and len are both hex)\n"
+          "  list [addr [len]]: disassemble memory, marking jump targets,\n"
+          "      basic blocks and unreachable data (default: 0x20 words at pc)\n"
           "  core: dump ram image to core.img\n"
+          "  mem: show how many pages of ram this instance has written\n"
+          "      (with --cow; otherwise, how many it has touched)\n"
+          "  save [file]: save cpu, ram and device state (default state.img)\n"
+          "  restore [file]: restore state saved with 'save'\n"
           "  exit, quit: exit emulator\n"
           "unambiguous abbreviations are recognized "
             "(e.g., s for step or con for continue).\n"
@@ -144,9 +163,49 @@ bool dcpu_debug(dcpu *dcpu) {
         }
       }
       dumpram(dcpu, addr, length);
+    } else if (matches(tok, "l", "list")) {
+      u16 addr = dcpu->pc;
+      uint32_t length = 0x20;
+      char *endptr;
+      tok = strtok(NULL, delim);
+      if (tok) {
+        addr = strtoul(tok, &endptr, 16);
+        if (*endptr) {
+          dcpu_msg("addr argument to 'list' must be a hex number\n");
+          continue;
+        }
+        tok = strtok(NULL, delim);
+      }
+      if (tok) {
+        length = strtoul(tok, &endptr, 16);
+        if (*endptr || length > RAM_WORDS) {
+          dcpu_msg("len argument to 'list' must be a hex number "
+              "no larger than 0x10000\n");
+          continue;
+        }
+      }
+      listing(dcpu, addr, length);
     } else if (matches(tok, "cor", "core")) {
       dcpu_coredump(dcpu, 0);
       dcpu_msg("core written to core.img\n");
+    } else if (matches(tok, "m", "mem")) {
+      unsigned own, total;
+      if (dcpu_ramstats(dcpu, &own, &total))
+        dcpu_msg("%u of %u pages of ram are private\n", own, total);
+      else
+        dcpu_msg("page usage isn't available on this platform\n");
+    } else if (matches(tok, "sa", "save")) {
+      tok = strtok(NULL, delim);
+      if (!tok) tok = STATEFILE_NAME;
+      if (dcpu_savestate(dcpu, tok)) dcpu_msg("state written to %s\n", tok);
+    } else if (matches(tok, "r", "restore")) {
+      tok = strtok(NULL, delim);
+      if (!tok) tok = STATEFILE_NAME;
+      if (dcpu_loadstate(dcpu, tok)) {
+        dcpu_msg("state restored from %s\n", tok);
+        dumpheader();
+        dumpstate(dcpu);
+      }
     } else if (matches(tok, "e", "exit")
         || matches(tok, "q", "quit")) {
       return false;
@@ -35,51 +35,426 @@
 #include "dcpu.h"
 #include "opcodes.h"
 
-static const char regs[8] = "abcxyzij";
-
-static u16 *dis_operand(u16 *pc, u16 n, char *out, char *pshp) {
-  if (n < 0x08) {
-    sprintf(out, "%c", regs[n & 7]);
-  } else if (n < 0x10) {
-    sprintf(out, "[%c]", regs[n & 7]);
-  } else if (n < 0x18) {
-    sprintf(out, "[0x%x+%c]", *pc++, regs[n & 7]);
-  } else if (n > 0x1f) {
-    sprintf(out, "0x%x", (u16)(n - 0x21));
-  } else switch (n) {
-    case 0x18: strcpy(out, pshp); break;
-    case 0x19: strcpy(out, "peek"); break;
-    case 0x1a: sprintf(out, "pick 0x%x", *pc++); break;
-    case 0x1b: strcpy(out, "sp"); break;
-    case 0x1c: strcpy(out, "pc"); break;
-    case 0x1d: strcpy(out, "ex"); break;
-    case 0x1e: sprintf(out, "[0x%04x]", *pc++); break;
-    case 0x1f: sprintf(out, "0x%x", *pc++); break;
+// operand formats, indexed by the 6-bit operand code. most operands render
+// as a fixed string. the rest splice in the following word of the
+// instruction stream, and the format says how.
+enum {
+  O_FIX,   // fixed text
+  O_PSHP,  // push or pop, depending on position
+  O_IDX,   // [next+reg]
+  O_PICK,  // pick next
+  O_IND,   // [next]
+  O_LIT    // next
+};
+
+#define HASNEXT(n) (operands[n].fmt >= O_IDX)
+
+static const struct operand_t {
+  uint8_t fmt;
+  const char *text;
+} operands[0x40] = {
+  {O_FIX, "a"}, {O_FIX, "b"}, {O_FIX, "c"}, {O_FIX, "x"},
+  {O_FIX, "y"}, {O_FIX, "z"}, {O_FIX, "i"}, {O_FIX, "j"},
+  {O_FIX, "[a]"}, {O_FIX, "[b]"}, {O_FIX, "[c]"}, {O_FIX, "[x]"},
+  {O_FIX, "[y]"}, {O_FIX, "[z]"}, {O_FIX, "[i]"}, {O_FIX, "[j]"},
+  {O_IDX, "a"}, {O_IDX, "b"}, {O_IDX, "c"}, {O_IDX, "x"},
+  {O_IDX, "y"}, {O_IDX, "z"}, {O_IDX, "i"}, {O_IDX, "j"},
+  {O_PSHP, NULL}, {O_FIX, "peek"}, {O_PICK, NULL}, {O_FIX, "sp"},
+  {O_FIX, "pc"}, {O_FIX, "ex"}, {O_IND, NULL}, {O_LIT, NULL},
+  {O_FIX, "0xffff"}, {O_FIX, "0x0"}, {O_FIX, "0x1"}, {O_FIX, "0x2"},
+  {O_FIX, "0x3"}, {O_FIX, "0x4"}, {O_FIX, "0x5"}, {O_FIX, "0x6"},
+  {O_FIX, "0x7"}, {O_FIX, "0x8"}, {O_FIX, "0x9"}, {O_FIX, "0xa"},
+  {O_FIX, "0xb"}, {O_FIX, "0xc"}, {O_FIX, "0xd"}, {O_FIX, "0xe"},
+  {O_FIX, "0xf"}, {O_FIX, "0x10"}, {O_FIX, "0x11"}, {O_FIX, "0x12"},
+  {O_FIX, "0x13"}, {O_FIX, "0x14"}, {O_FIX, "0x15"}, {O_FIX, "0x16"},
+  {O_FIX, "0x17"}, {O_FIX, "0x18"}, {O_FIX, "0x19"}, {O_FIX, "0x1a"},
+  {O_FIX, "0x1b"}, {O_FIX, "0x1c"}, {O_FIX, "0x1d"}, {O_FIX, "0x1e"},
+};
+
+static const char hexdigits[] = "0123456789abcdef";
+
+// append "0x" and the hex digits of n, zero-padded to at least width.
+static char *puthex(char *out, u16 n, int width) {
+  int digits = 4;
+  while (digits > width && digits > 1 && !(n >> (4 * (digits - 1))))
+    digits--;
+  *out++ = '0';
+  *out++ = 'x';
+  while (digits--) *out++ = hexdigits[(n >> (4 * digits)) & 0xf];
+  return out;
+}
+
+// append the four hex digits of n, without a prefix.
+static char *putword(char *out, u16 n) {
+  for (int d = 3; d >= 0; d--) *out++ = hexdigits[(n >> (4 * d)) & 0xf];
+  return out;
+}
+
+static char *putstr(char *out, const char *s) {
+  while (*s) *out++ = *s++;
+  return out;
+}
+
+static char *dis_operand(const u16 **pc, u16 n, char *out, const char *pshp) {
+  const struct operand_t *o = &operands[n];
+  switch (o->fmt) {
+    case O_FIX:
+      return putstr(out, o->text);
+    case O_PSHP:
+      return putstr(out, pshp);
+    case O_IDX:
+      *out++ = '[';
+      out = puthex(out, *(*pc)++, 1);
+      *out++ = '+';
+      out = putstr(out, o->text);
+      *out++ = ']';
+      return out;
+    case O_PICK:
+      return puthex(putstr(out, "pick "), *(*pc)++, 1);
+    case O_IND:
+      *out++ = '[';
+      out = puthex(out, *(*pc)++, 4);
+      *out++ = ']';
+      return out;
+    default: // O_LIT
+      return puthex(out, *(*pc)++, 1);
   }
-  return pc;  
 }
 
-u16 *dcpu_disassemble(u16 *pc, char *out) {
+static const u16 *disasm(const u16 *pc, char *out) {
   u16 n = *pc++;
   u16 op = get_opcode(n);
   u16 b = arg_b(n);
   u16 a = arg_a(n);
   if (op > 0) {
-    sprintf(out, "%s ", opnames[op]);
-    char tmp[64];
-    pc = dis_operand(pc, a, tmp, "pop"); 
-    pc = dis_operand(pc, b, out + strlen(out), "push");
-    strcat(out, ", ");
-    strcat(out, tmp);
-    return pc;
-  }
-  if (b > 0 && b < NUM_SPOPCODES && spopnames[b]) {
-    sprintf(out, "%s ", spopnames[b]);
-    pc = dis_operand(pc, a, out+strlen(out), "pop");
-    return pc;
+    // a is decoded first, so its next word (if any) comes first...
+    char tmp[32];
+    char *end = dis_operand(&pc, a, tmp, "pop");
+    *end = '\0';
+    out = putstr(out, opnames[op]);
+    *out++ = ' ';
+    out = dis_operand(&pc, b, out, "push");
+    *out++ = ',';
+    *out++ = ' ';
+    out = putstr(out, tmp);
+  } else {
+    if (b > 0 && b < NUM_SPOPCODES && spopnames[b]) {
+      out = putstr(out, spopnames[b]);
+    } else {
+      out = putstr(out, "unk[");
+      *out++ = hexdigits[b >> 4];
+      *out++ = hexdigits[b & 0xf];
+      *out++ = ']';
+    }
+    *out++ = ' ';
+    out = dis_operand(&pc, a, out, "pop");
   }
-  sprintf(out,"unk[%02x] ", b);
-  pc = dis_operand(pc, a, out+strlen(out), "pop");
+  *out = '\0';
   return pc;
 }
 
+u16 *dcpu_disassemble(u16 *pc, char *out) {
+  return pc + (disasm(pc, out) - pc);
+}
+
+u16 dcpu_inslen(u16 instr) {
+  if (!get_opcode(instr)) return 1 + HASNEXT(arg_a(instr));
+  return 1 + HASNEXT(arg_a(instr)) + HASNEXT(arg_b(instr));
+}
+
+
+// control flow recovery. we do a simple recursive descent from a set of
+// entry points, following direct jumps, calls and conditional skips. anything
+// never reached is assumed to be data. indirect jumps (set pc, [x], etc.)
+// simply end a path, so code reachable only through tables or computed
+// addresses will show up as data unless it's given as an entry point.
+
+#define ARG_PSHP 0x18
+#define ARG_PC   0x1c
+#define ARG_NXL  0x1f
+
+// an instruction's effect on control flow.
+struct flow_t {
+  u16 len;
+  bool valid;   // a real instruction, rather than a reserved opcode
+  bool falls;   // execution may continue with the following instruction
+  bool ends;    // the instruction ends a basic block
+  int ntargets;
+  u16 targets[2];
+  uint8_t kinds[2];
+};
+
+// fetch the instruction at pc into w, taking care to wrap at the top of ram.
+static void fetch(const u16 *ram, u16 pc, u16 *w) {
+  for (u16 i = 0; i < 3; i++) w[i] = ram[(u16)(pc + i)];
+}
+
+// the value of a literal operand, if it is one.
+static bool literal(u16 n, u16 next, u16 *val) {
+  if (n >= 0x20) *val = n - 0x21;
+  else if (n == ARG_NXL) *val = next;
+  else return false;
+  return true;
+}
+
+static bool isif(u16 instr) {
+  u16 op = get_opcode(instr);
+  return op >= OP_IFB && op <= OP_IFU;
+}
+
+static void target(struct flow_t *f, u16 addr, uint8_t kind) {
+  f->targets[f->ntargets] = addr;
+  f->kinds[f->ntargets++] = kind;
+}
+
+static void analyze(const u16 *ram, u16 pc, struct flow_t *f) {
+  u16 w[3];
+  fetch(ram, pc, w);
+  u16 op = get_opcode(w[0]);
+  u16 a = arg_a(w[0]);
+  u16 b = arg_b(w[0]);
+  u16 val;
+
+  f->len = dcpu_inslen(w[0]);
+  f->valid = true;
+  f->falls = true;
+  f->ends = false;
+  f->ntargets = 0;
+  u16 next = pc + f->len;
+
+  if (!op) {
+    if (b >= NUM_SPOPCODES || !spopnames[b]) {
+      f->valid = f->falls = false;
+      return;
+    }
+    switch (b) {
+      case OP_SP_JSR:
+        if (literal(a, w[1], &val)) target(f, val, DIS_CALL);
+        break;
+      case OP_SP_IAS:
+        if (literal(a, w[1], &val) && val) target(f, val, DIS_INT);
+        break;
+      case OP_SP_DIE:
+      case OP_SP_RFI:
+        f->falls = false;
+        f->ends = true;
+        break;
+    }
+    return;
+  }
+
+  if (op == OP_XX0 || op == OP_XX1 || op == OP_XX2 || op == OP_XX3) {
+    f->valid = f->falls = false;
+    return;
+  }
+
+  if (isif(w[0])) {
+    // a conditional skips the whole of the next instruction. (a chain of
+    // conditionals skips further, but the next one in the chain will
+    // account for that when it's analyzed.)
+    u16 skipped[3];
+    fetch(ram, next, skipped);
+    f->ends = true;
+    target(f, next, DIS_SKIP);
+    target(f, next + dcpu_inslen(skipped[0]), DIS_SKIP);
+    return;
+  }
+
+  if (b != ARG_PC) return;
+
+  // anything else that writes pc is a jump of some kind. a jump preceded by
+  // a conditional may of course fall through, but the conditional itself
+  // accounts for that.
+  f->falls = false;
+  f->ends = true;
+  u16 lit = HASNEXT(a) ? w[1] : 0;
+  if (!literal(a, lit, &val)) return; // return, or indirect jump
+  switch (op) {
+    case OP_SET: target(f, val, DIS_JUMP); break;
+    case OP_ADD: target(f, next + val, DIS_JUMP); break;
+    case OP_SUB: target(f, next - val, DIS_JUMP); break;
+  }
+}
+
+void dcpu_flow(const u16 *ram, const u16 *entries, int nentries,
+    uint8_t *flags) {
+  static u16 work[RAM_WORDS];
+  int nwork = 0;
+
+  memset(flags, 0, RAM_WORDS);
+  for (int i = 0; i < nentries; i++) {
+    flags[entries[i]] |= DIS_BLOCK | DIS_ENTRY;
+    work[nwork++] = entries[i];
+  }
+
+  while (nwork) {
+    u16 pc = work[--nwork];
+    for (;;) {
+      if (flags[pc] & (DIS_CODE | DIS_ARG)) break; // already seen
+      struct flow_t f;
+      analyze(ram, pc, &f);
+      if (!f.valid) break;
+
+      // don't let an instruction overlap one we've already decoded...
+      bool overlaps = false;
+      for (u16 i = 1; i < f.len; i++)
+        if (flags[(u16)(pc + i)] & (DIS_CODE | DIS_ARG)) overlaps = true;
+      if (overlaps) break;
+
+      flags[pc] |= DIS_CODE;
+      for (u16 i = 1; i < f.len; i++) flags[(u16)(pc + i)] |= DIS_ARG;
+
+      for (int i = 0; i < f.ntargets; i++) {
+        u16 t = f.targets[i];
+        flags[t] |= DIS_BLOCK | f.kinds[i];
+        if (!(flags[t] & DIS_CODE) && nwork < RAM_WORDS) work[nwork++] = t;
+      }
+
+      pc += f.len;
+      if (!f.falls) break;
+      if (f.ends) flags[pc] |= DIS_BLOCK;
+    }
+  }
+}
+
+
+// listings. each line is handed to emit as it's completed.
+
+#define DATA_PER_LINE 8
+#define ZERO_RUN      16
+
+static char *label(char *out, uint8_t flags) {
+  if (flags & DIS_ENTRY) return putstr(out, "entry");
+  if (flags & DIS_INT) return putstr(out, "int");
+  if (flags & DIS_CALL) return putstr(out, "sub");
+  return putstr(out, "loc");
+}
+
+static uint32_t list_code(const u16 *ram, const uint8_t *flags, u16 addr,
+    char *line) {
+  u16 w[3];
+  fetch(ram, addr, w);
+  u16 len = dcpu_inslen(w[0]);
+  char *out = putword(line, addr);
+  *out++ = ':';
+  for (u16 i = 0; i < 3; i++) {
+    *out++ = ' ';
+    out = i < len ? putword(out, w[i]) : putstr(out, "    ");
+  }
+  out = putstr(out, "   ");
+  char *ins = out;
+  disasm(w, out);
+  out += strlen(out);
+
+  struct flow_t f;
+  analyze(ram, addr, &f);
+  if (f.ntargets && !isif(w[0])) {
+    while (out - ins < 24) *out++ = ' ';
+    out = putstr(out, " ; -> ");
+    out = label(out, flags[f.targets[0]]);
+    *out++ = '_';
+    out = putword(out, f.targets[0]);
+  }
+  *out = '\0';
+  return len;
+}
+
+static uint32_t list_data(const u16 *ram, const uint8_t *flags, u16 addr,
+    uint32_t limit, char *line) {
+  // a long run of zeros is collapsed into a single line...
+  uint32_t run = 0;
+  while (run < limit && !ram[(u16)(addr + run)]
+      && !(flags[(u16)(addr + run)] & (DIS_CODE | DIS_BLOCK)))
+    run++;
+  char *out = putstr(putword(line, addr), ":                  dw ");
+  if (run >= ZERO_RUN) {
+    out = putstr(out, "0 ; x ");
+    out = puthex(out, run, 1);
+    *out = '\0';
+    return run;
+  }
+
+  uint32_t n = 0;
+  do {
+    if (n) out = putstr(out, ", ");
+    out = puthex(out, ram[(u16)(addr + n)], 4);
+    n++;
+  } while (n < limit && n < DATA_PER_LINE
+      && !(flags[(u16)(addr + n)] & (DIS_CODE | DIS_BLOCK)));
+  *out = '\0';
+  return n;
+}
+
+void dcpu_listing(const u16 *ram, const uint8_t *flags, u16 addr,
+    uint32_t len, void (*emit)(const char *)) {
+  char line[128];
+  while (len) {
+    uint8_t fl = flags[addr];
+    bool labeled = fl & (DIS_JUMP | DIS_CALL | DIS_INT | DIS_ENTRY);
+    // blocks split off by a conditional are only set apart if labeled, to
+    // keep if-chains readable...
+    if (labeled || (fl & (DIS_BLOCK | DIS_SKIP)) == DIS_BLOCK) emit("");
+    if (labeled) {
+      char *out = label(line, fl);
+      *out++ = '_';
+      out = putstr(putword(out, addr), ":");
+      *out = '\0';
+      emit(line);
+    }
+    uint32_t n = fl & DIS_CODE
+      ? list_code(ram, flags, addr, line)
+      : list_data(ram, flags, addr, len, line);
+    emit(line);
+    if (n > len) n = len;
+    len -= n;
+    addr += n;
+  }
+}
+
+void dcpu_cfg(const u16 *ram, const uint8_t *flags,
+    void (*emit)(const char *)) {
+  char line[128];
+  for (uint32_t start = 0; start < RAM_WORDS; start++) {
+    if (!(flags[start] & DIS_BLOCK) || !(flags[start] & DIS_CODE)) continue;
+
+    char *out = line;
+    out = puthex(out, start, 4);
+    *out++ = ' ';
+    char *calls = out + 6; // leave room for the end address
+
+    // walk to the last instruction of the block, noting where each one
+    // leads. only the last can branch, but calls and ias can be anywhere.
+    u16 pc = start;
+    struct flow_t f;
+    for (;;) {
+      analyze(ram, pc, &f);
+      u16 next = pc + f.len;
+      for (int i = 0; i < f.ntargets && calls - line < 100; i++) {
+        uint8_t k = f.kinds[i];
+        if (k == DIS_SKIP) continue; // below, once we know where it ends
+        calls = putstr(calls, k == DIS_CALL ? " call:"
+            : k == DIS_INT ? " int:" : " jump:");
+        calls = puthex(calls, f.targets[i], 4);
+      }
+      if (f.ends || !f.falls || flags[next] & DIS_BLOCK
+          || !(flags[next] & DIS_CODE))
+        break;
+      pc = next;
+    }
+    u16 end = pc + f.len;
+
+    puthex(out, end, 4);
+    out = calls;
+    for (int i = 0; i < f.ntargets; i++) {
+      if (f.kinds[i] != DIS_SKIP) continue; // already noted
+      out = putstr(out, " cond:");
+      out = puthex(out, f.targets[i], 4);
+    }
+    if (f.falls && !isif(ram[pc])) {
+      out = putstr(out, " fall:");
+      out = puthex(out, end, 4);
+    }
+    *out = '\0';
+    emit(line);
+  }
+}
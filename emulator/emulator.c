@@ -26,11 +26,16 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <sched.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 #if defined(DCPU_MACOSX)
 #include <mach/mach_time.h>
 #endif
@@ -60,10 +65,15 @@ tstamp_t dcpu_now() {
 
 
 static inline void await_tick(dcpu *dcpu) {
-  tstamp_t now = dcpu_now();
+  dcpu->cycles++;
+  // devices on an unpaced cpu see a clock that never moves. they had better
+  // count cycles instead.
+  tstamp_t now = dcpu->unpaced ? 0 : dcpu_now();
   // tick hardware devices
   for (int i = 0; i < dcpu->nhw; i++)
-    dcpu->hw[i].tick(dcpu, now);
+    if (dcpu->hw[i].tick)
+      dcpu->hw[i].tick(dcpu, &dcpu->hw[i], now);
+  if (dcpu->unpaced) return;
   if (now < dcpu->nexttick) {
     struct timespec ts = { 0, dcpu->nexttick - now };
     // don't care about failures. if we get a signal, we're gonna bail anyway.
@@ -75,17 +85,162 @@ static inline void await_tick(dcpu *dcpu) {
 
 void dcpu_init(dcpu *dcpu, uint32_t khz) {
   dcpu->tickns = 1000000 / khz;
+  dcpu->unpaced = false;
+  dcpu->cycles = 0;
 
   dcpu->sp = 0;
   dcpu->pc = 0;
   dcpu->ex = 0;
   dcpu->ia = 0;
   for (int i = 0; i < NREGS; i++) dcpu->reg[i] = 0;
-  for (int i = 0; i < RAM_WORDS; i++) dcpu->ram[i] = 0;
+  // anonymous memory is zeroed, and pages the guest never touches cost nothing
+  dcpu->ram = mmap(NULL, RAM_WORDS * sizeof(u16), PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANON, -1, 0);
+  if (dcpu->ram == MAP_FAILED) {
+    dcpu_exitmsg("error mapping ram: %s\n", strerror(errno));
+    exit(1);
+  }
+  // everything starts out dirty, in particular whatever we load from the image
+  for (int i = 0; i < DIRTY_PAGES; i++) dcpu->dirty[i] = 0xff;
   dcpu->qints = false;
   dcpu->intqwrite = 0;
   dcpu->intqread = 0;
   dcpu->nhw = 0;
+  dcpu->hwcap = 0;
+  dcpu->hw = NULL;
+}
+
+// add a device to the end of the table. all hooks start out NULL.
+device *dcpu_addhw(dcpu *dcpu) {
+  if (dcpu->nhw == dcpu->hwcap) {
+    if (dcpu->hwcap == HW_MAX) {
+      dcpu_exitmsg("too many hardware devices\n");
+      exit(1);
+    }
+    uint32_t cap = dcpu->hwcap ? dcpu->hwcap * 2 : 8;
+    if (cap > HW_MAX) cap = HW_MAX;
+    device *hw = realloc(dcpu->hw, cap * sizeof(device));
+    if (!hw) {
+      dcpu_exitmsg("out of memory adding hardware device\n");
+      exit(1);
+    }
+    dcpu->hw = hw;
+    dcpu->hwcap = cap;
+  }
+  device *dev = &dcpu->hw[dcpu->nhw++];
+  memset(dev, 0, sizeof(*dev));
+  return dev;
+}
+
+void dcpu_killhw(dcpu *dcpu) {
+  for (int i = 0; i < dcpu->nhw; i++)
+    if (dcpu->hw[i].kill)
+      dcpu->hw[i].kill(dcpu, &dcpu->hw[i]);
+  free(dcpu->hw);
+  dcpu->hw = NULL;
+  dcpu->nhw = dcpu->hwcap = 0;
+}
+
+// write image out in native byte order, padded to the full size of ram, to a
+// file that instances can map copy-on-write with dcpu_mapram(), so they share
+// every page they haven't written to. the file is cache if given, which is
+// reused (and so shared between processes) if it's newer than the image,
+// otherwise an anonymous temporary one. returns its descriptor, or -1.
+int dcpu_cowbase(const char *image, bool bigend, const char *cache) {
+  struct stat ist, cst;
+  if (stat(image, &ist)) {
+    dcpu_exitmsg("error reading image '%s': %s\n", image, strerror(errno));
+    return -1;
+  }
+  if (cache && !stat(cache, &cst) && cst.st_mtime >= ist.st_mtime
+      && cst.st_size == RAM_WORDS * sizeof(u16)) {
+    int fd = open(cache, O_RDONLY);
+    if (fd >= 0) {
+      dcpu_msg("using copy-on-write base %s\n", cache);
+      return fd;
+    }
+  }
+
+  // build it in an ordinary instance, then write it out in one go
+  dcpu tmp;
+  dcpu_init(&tmp, 1);
+  if (!dcpu_loadcore(&tmp, image, bigend)) return -1;
+
+  // replace the cache atomically, since other processes may be using it
+  char path[4096];
+  const char *dir = getenv("TMPDIR");
+  snprintf(path, sizeof(path), "%s%s", cache ? cache : dir ? dir : "/tmp",
+      cache ? ".XXXXXX" : "/dcpu-ram.XXXXXX");
+  int fd = mkstemp(path);
+  bool ok = fd >= 0
+    && !fchmod(fd, 0644)
+    && write(fd, tmp.ram, RAM_WORDS * sizeof(u16))
+       == RAM_WORDS * sizeof(u16)
+    && (cache ? !rename(path, cache) : !unlink(path));
+  if (!ok) {
+    dcpu_exitmsg("error writing copy-on-write base '%s': %s\n",
+        cache ? cache : path, strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+      unlink(path);
+    }
+    fd = -1;
+  }
+  dcpu_killram(&tmp);
+  return fd;
+}
+
+// replace ram with a private, copy-on-write mapping of base
+bool dcpu_mapram(dcpu *dcpu, int base) {
+  u16 *ram = mmap(NULL, RAM_WORDS * sizeof(u16), PROT_READ | PROT_WRITE,
+      MAP_PRIVATE, base, 0);
+  if (ram == MAP_FAILED) {
+    dcpu_exitmsg("error mapping ram: %s\n", strerror(errno));
+    return false;
+  }
+  dcpu_killram(dcpu);
+  dcpu->ram = ram;
+  memset(dcpu->dirty, 0xff, sizeof(dcpu->dirty));
+  return true;
+}
+
+void dcpu_killram(dcpu *dcpu) {
+  if (dcpu->ram) munmap(dcpu->ram, RAM_WORDS * sizeof(u16));
+  dcpu->ram = NULL;
+}
+
+// count the host pages of ram that belong to this instance alone: the ones
+// written to, for a copy-on-write mapping. only possible on linux, where
+// /proc/self/pagemap says which pages are backed by anonymous memory.
+bool dcpu_ramstats(dcpu *dcpu, unsigned *own, unsigned *total) {
+  long pagesize = sysconf(_SC_PAGESIZE);
+  *total = RAM_WORDS * sizeof(u16) / pagesize;
+  *own = 0;
+#ifdef DCPU_LINUX
+  int fd = open("/proc/self/pagemap", O_RDONLY);
+  if (fd < 0) return false;
+  // a batch at a time, since there's no telling how many pages there are
+  uint64_t entries[64];
+  off_t at = (uintptr_t)dcpu->ram / pagesize * sizeof(uint64_t);
+  for (unsigned i = 0; i < *total; i += 64) {
+    unsigned k = *total - i < 64 ? *total - i : 64;
+    ssize_t n = pread(fd, entries, k * sizeof(uint64_t),
+        at + i * sizeof(uint64_t));
+    if (n != (ssize_t)(k * sizeof(uint64_t))) {
+      close(fd);
+      return false;
+    }
+    for (unsigned j = 0; j < k; j++) {
+      bool present = entries[j] >> 63 & 1, file = entries[j] >> 61 & 1;
+      if (present && !file) (*own)++;
+    }
+  }
+  close(fd);
+  return true;
+#else
+  (void)dcpu;
+  return false;
+#endif
 }
 
 bool dcpu_loadcore(dcpu *dcpu, const char *image, bool bigend) {
@@ -103,9 +258,9 @@ bool dcpu_loadcore(dcpu *dcpu, const char *image, bool bigend) {
 
   dcpu_msg("loaded image from %s: 0x%05x words\n", image, img_size);
 
-  // swap byte order...
+  // swap byte order. the rest of ram is still zero, and left untouched.
   if (bigend)
-    for (int i = 0; i < RAM_WORDS; i++)
+    for (int i = 0; i < img_size; i++)
       dcpu->ram[i] = (dcpu->ram[i] >> 8) | ((dcpu->ram[i] & 0xff) << 8);
 
   fclose(img);
@@ -142,7 +297,7 @@ void dcpu_interrupt(dcpu *dcpu, u16 interrupt) {
     dcpu->intq[dcpu->intqwrite] = interrupt;
     dcpu->intqwrite = nextwrite;
   } else {
-    dcpu_msg("interrupt queue overflow! discarding: 0x%04x\n", interrupt);
+    dcpu_log(L_WARN, "interrupt queue overflow! discarding: 0x%04x\n", interrupt);
     // break via variable, since interrupts can be raised by hardware at
     // "arbitrary" times
     dcpu_break = true;
@@ -155,8 +310,8 @@ static void trigger_int(dcpu *dcpu) {
     if (dcpu->ia != 0) {
       // handler is configured, deliver the interrupt.
       dcpu->qints = true;
-      dcpu->ram[--dcpu->sp] = dcpu->pc;
-      dcpu->ram[--dcpu->sp] = dcpu->reg[REG_A];
+      dcpu_write(dcpu, --dcpu->sp, dcpu->pc);
+      dcpu_write(dcpu, --dcpu->sp, dcpu->reg[REG_A]);
       dcpu->pc = dcpu->ia;
       dcpu->reg[REG_A] = dcpu->intq[dcpu->intqread];
     }
@@ -253,8 +408,15 @@ static u16 decode_arg(dcpu *dcpu, uint8_t arg, u16 **addr, bool effects,
 }
 
 
-static inline void set(u16 *dest, u16 val) {
-  if (dest) *dest = val;
+static inline void set(dcpu *dcpu, u16 *dest, u16 val) {
+  if (dest) {
+    *dest = val;
+    // dest may be a register rather than ram. compare as integers, since
+    // comparing pointers into different objects isn't strictly legit...
+    uintptr_t offset = (uintptr_t)dest - (uintptr_t)dcpu->ram;
+    if (offset < RAM_WORDS * sizeof(u16))
+      dcpu->dirty[offset / sizeof(u16) >> DIRTY_SHIFT] = 0xff;
+  }
   // otherwise, attempt to write a literal: a silent fault.
 }
 
@@ -291,42 +453,42 @@ static action_t execute(dcpu *dcpu, u16 instr) {
 
   switch (opcode) {
     case OP_SET:
-      set(dest, a);
+      set(dcpu, dest, a);
       break;
 
     case OP_ADD: {
       u16 sum = b + a;
-      set(dest, sum);
+      set(dcpu, dest, sum);
       dcpu->ex = sum < b ? 0x1 : 0;
       await_tick(dcpu);
       break;
     }
 
     case OP_SUB:
-      set(dest, b - a);
+      set(dcpu, dest, b - a);
       dcpu->ex = b < a ? 0xffff : 0;
       await_tick(dcpu);
       break;
 
     case OP_MUL:
-      set(dest, b * a);
-      dcpu->ex = ((b * a) >> 16) & 0xffff; // per spec
+      set(dcpu, dest, b * a);
+      dcpu->ex = (((uint32_t)b * a) >> 16) & 0xffff; // per spec
       await_tick(dcpu);
       break;
 
     case OP_MLI:
-      set(dest, S(b) * S(a));
+      set(dcpu, dest, S(b) * S(a));
       dcpu->ex = ((S(b) * S(a)) >> 16) & 0xffff; // per spec
       await_tick(dcpu);
       break;
 
     case OP_DIV:
       if (a == 0) {
-        set(dest, 0);
+        set(dcpu, dest, 0);
         dcpu->ex = 0;
       } else {
-        set(dest, b / a);
-        dcpu->ex = ((b << 16) / a) & 0xffff; // per spec
+        set(dcpu, dest, b / a);
+        dcpu->ex = (((uint32_t)b << 16) / a) & 0xffff; // per spec
       }
       await_tick(dcpu);
       await_tick(dcpu);
@@ -334,11 +496,11 @@ static action_t execute(dcpu *dcpu, u16 instr) {
 
     case OP_DVI:
       if (a == 0) {
-        set(dest, 0);
+        set(dcpu, dest, 0);
         dcpu->ex = 0;
       } else {
         // TODO this should be enforced manually, but gcc/x86 does what we want...
-        set(dest, S(b) / S(a));
+        set(dcpu, dest, S(b) / S(a));
         dcpu->ex = ((S(b) << 16) / S(a)) & 0xffff; // per spec
       }
       await_tick(dcpu);
@@ -347,49 +509,49 @@ static action_t execute(dcpu *dcpu, u16 instr) {
 
     case OP_MOD:
       if (a == 0)
-        set(dest, 0);
+        set(dcpu, dest, 0);
       else
-        set(dest, b % a);
+        set(dcpu, dest, b % a);
       await_tick(dcpu);
       await_tick(dcpu);
       break;
 
     case OP_MDI:
       if (a == 0)
-        set(dest, 0);
+        set(dcpu, dest, 0);
       else
         // TODO this should be enforced manually, but gcc/x86 does what we want...
-        set(dest, S(b) % S(a));
+        set(dcpu, dest, S(b) % S(a));
       await_tick(dcpu);
       await_tick(dcpu);
       break;
 
     case OP_AND:
-      set(dest, b & a);
+      set(dcpu, dest, b & a);
       break;
 
     case OP_BOR:
-      set(dest, b | a);
+      set(dcpu, dest, b | a);
       break;
 
     case OP_XOR:
-      set(dest, b ^ a);
+      set(dcpu, dest, b ^ a);
       break;
 
     case OP_SHR:
-      set(dest, b >> a);
-      dcpu->ex = ((b << 16) >> a) & 0xffff; // per spec
+      set(dcpu, dest, b >> a);
+      dcpu->ex = (((uint32_t)b << 16) >> a) & 0xffff; // per spec
       break;
 
     case OP_ASR:
       // TODO this should be enforced manually, but gcc/x86 does what we want...
-      set(dest, S(b) >> a);
+      set(dcpu, dest, S(b) >> a);
       dcpu->ex = ((S(b) << 16) >> a) & 0xffff; // per spec
       break;
 
     case OP_SHL:
-      set(dest, b << a);
-      dcpu->ex = ((b << a) >> 16) & 0xffff; // per spec
+      set(dcpu, dest, b << a);
+      dcpu->ex = (((uint32_t)b << a) >> 16) & 0xffff; // per spec
       break;
 
     case OP_IFB:
@@ -434,7 +596,7 @@ static action_t execute(dcpu *dcpu, u16 instr) {
 
     case OP_ADX: {
       uint32_t sum = b + a + dcpu->ex;
-      set(dest, sum);
+      set(dcpu, dest, sum);
       dcpu->ex = sum >> 16; // assuming the inevitable spec update...
       await_tick(dcpu);
       await_tick(dcpu);
@@ -443,7 +605,7 @@ static action_t execute(dcpu *dcpu, u16 instr) {
  
     case OP_SBX: {
       uint32_t diff = b - a + dcpu->ex;
-      set(dest, diff);
+      set(dcpu, dest, diff);
       dcpu->ex = diff >> 16; // TODO seems like the right thing to me, the spec needs an update. i think the real problem is that SUB should leave 1 in EX rather than 0xffff
       await_tick(dcpu);
       await_tick(dcpu);
@@ -451,14 +613,14 @@ static action_t execute(dcpu *dcpu, u16 instr) {
     }
 
     case OP_STI:
-      set(dest, a);
+      set(dcpu, dest, a);
       dcpu->reg[REG_I]++;
       dcpu->reg[REG_J]++;
       await_tick(dcpu);
       break;
 
     case OP_STD:
-      set(dest, a);
+      set(dcpu, dest, a);
       dcpu->reg[REG_I]--;
       dcpu->reg[REG_J]--;
       await_tick(dcpu);
@@ -481,7 +643,7 @@ static action_t exec_special(dcpu *dcpu, u16 instr) {
 
   switch (opcode) {
     case OP_SP_JSR:
-      dcpu->ram[--dcpu->sp] = dcpu->pc;
+      dcpu_write(dcpu, --dcpu->sp, dcpu->pc);
       dcpu->pc = a;
       break;
 
@@ -503,7 +665,7 @@ static action_t exec_special(dcpu *dcpu, u16 instr) {
       break;
 
     case OP_SP_IAG:
-      set(dest, dcpu->ia);
+      set(dcpu, dest, dcpu->ia);
       break;
 
     case OP_SP_IAS:
@@ -524,7 +686,7 @@ static action_t exec_special(dcpu *dcpu, u16 instr) {
       break;
 
     case OP_SP_HWN:
-      set(dest, dcpu->nhw);
+      set(dcpu, dest, dcpu->nhw);
       await_tick(dcpu);
       break;
 
@@ -545,7 +707,7 @@ static action_t exec_special(dcpu *dcpu, u16 instr) {
 
     case OP_SP_HWI:
       if (a < dcpu->nhw) {
-        u16 cycles = dcpu->hw[a].hwi(dcpu);
+        u16 cycles = dcpu->hw[a].hwi(dcpu, &dcpu->hw[a]);
         while (cycles--) await_tick(dcpu);
       }
       await_tick(dcpu);
@@ -563,14 +725,35 @@ static action_t exec_special(dcpu *dcpu, u16 instr) {
 }
 
 
+// a single-instruction loop with interrupts enabled (say, 'sub pc, 1') is
+// the guest idling until the next one. nothing can change until a device
+// raises it, so rather than pacing the loop a cycle at a time, sleep a
+// millisecond ahead at once and let the cycles that follow catch up. the
+// guest sees exactly the same cycles and device ticks, only the host wakes up
+// less often (and an interrupt may be taken up to a millisecond late).
+#define IDLE_NS 1000000
+
+static void idle(dcpu *dcpu) {
+  if (dcpu->unpaced) return;
+  tstamp_t now = dcpu_now();
+  if (now >= dcpu->nexttick) return; // behind already
+  tstamp_t ns = dcpu->nexttick + IDLE_NS - now;
+  struct timespec ts = { ns / 1000000000, ns % 1000000000 };
+  nanosleep(&ts, NULL);
+}
+
 action_t dcpu_step(dcpu *dcpu) {
   u16 oldpc = dcpu->pc;
   u16 instr = next(dcpu, true);
   int result = execute(dcpu, instr);
   trigger_int(dcpu);
-  if (dcpu->detect_loops && dcpu->pc == oldpc) {
-    dcpu_msg("loop detected.\n");
-    return A_BREAK;
+  if (dcpu->pc == oldpc) {
+    if (dcpu->ia && !dcpu->qints) {
+      idle(dcpu);
+    } else if (dcpu->detect_loops) {
+      dcpu_msg("loop detected.\n");
+      return A_BREAK;
+    }
   }
   return result;
 }
@@ -578,7 +761,10 @@ action_t dcpu_step(dcpu *dcpu) {
 
 void dcpu_run(dcpu *dcpu, bool debugboot) {
   bool running = true;
-  if (debugboot) running = dcpu_debug(dcpu);
+  if (debugboot) {
+    dcpu_dbgterm();
+    running = dcpu_debug(dcpu);
+  }
   dcpu_msg("running...\n");
   dcpu_runterm();
   dcpu->nexttick = dcpu_now() + dcpu->tickns;
@@ -590,7 +776,7 @@ void dcpu_run(dcpu *dcpu, bool debugboot) {
       // allow to force a vram redraw or whatever else before entering debugger
       for (int i = 0; i < dcpu->nhw; i++)
         if (dcpu->hw[i].on_debug)
-          dcpu->hw[i].on_debug(dcpu);
+          dcpu->hw[i].on_debug(dcpu, &dcpu->hw[i]);
       dcpu_dbgterm();
       running = dcpu_debug(dcpu);
       if (running) dcpu_msg("running...\n");
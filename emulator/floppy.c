@@ -0,0 +1,291 @@
+/*
+ * Copyright (c) 2012, Matt Hellige
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above copyright notice, 
+ *   this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above copyright 
+ *   notice, this list of conditions and the following disclaimer in the 
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR 
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT 
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, 
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY 
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dcpu.h"
+
+// the mackapar m35fd 3.5" floppy drive. each drive is backed by an image file
+// (big-endian, like everything else) that's mapped into memory, so sector
+// transfers are just copies between the mapping and guest ram. transfers
+// take as long as the spec says, in emulated cycles, unless the drive is in
+// fast mode, in which case they complete on the next cycle.
+
+#define FD_TRACKS       80
+#define FD_SECTORS      18 // per track
+#define FD_SECTOR_WORDS 512
+#define FD_IMAGE_WORDS  (FD_TRACKS * FD_SECTORS * FD_SECTOR_WORDS)
+#define FD_SEEK_NS      2400000 // per track
+#define FD_WORDS_PER_S  30700
+
+enum {
+  STATE_NO_MEDIA = 0,
+  STATE_READY,
+  STATE_READY_WP,
+  STATE_BUSY,
+};
+
+enum {
+  ERROR_NONE = 0,
+  ERROR_BUSY,
+  ERROR_NO_MEDIA,
+  ERROR_PROTECTED,
+  ERROR_EJECT,
+  ERROR_BAD_SECTOR,
+  ERROR_BROKEN = 0xffff,
+};
+
+struct floppy_t {
+  const char *path;
+  uint8_t *disk; // the mapped image, or NULL if no media
+  bool ro;
+  bool fast;
+  u16 state;
+  u16 error;
+  u16 msg;
+  u16 track;
+
+  // the transfer in progress, if state is busy
+  bool writing;
+  u16 sector;
+  u16 addr;
+  uint64_t done; // cycle count at completion
+};
+
+static void set_status(dcpu *dcpu, struct floppy_t *fd, u16 state, u16 error) {
+  bool changed = state != fd->state || error != fd->error;
+  fd->state = state;
+  fd->error = error;
+  if (changed && fd->msg) dcpu_interrupt(dcpu, fd->msg);
+}
+
+static void transfer(dcpu *dcpu, struct floppy_t *fd) {
+  uint8_t *p = fd->disk + (size_t)fd->sector * FD_SECTOR_WORDS * 2;
+  u16 addr = fd->addr;
+  if (fd->writing) {
+    for (int i = 0; i < FD_SECTOR_WORDS; i++, addr++, p += 2) {
+      p[0] = dcpu->ram[addr] >> 8;
+      p[1] = dcpu->ram[addr];
+    }
+  } else {
+    for (int i = 0; i < FD_SECTOR_WORDS; i++, addr++, p += 2)
+      dcpu_write(dcpu, addr, (p[0] << 8) | p[1]);
+  }
+}
+
+static u16 idle_state(struct floppy_t *fd) {
+  if (!fd->disk) return STATE_NO_MEDIA;
+  return fd->ro ? STATE_READY_WP : STATE_READY;
+}
+
+// start a read or write, leaving the result of the request in b
+static void start(dcpu *dcpu, struct floppy_t *fd, bool writing) {
+  u16 sector = dcpu->reg[REG_X];
+  dcpu->reg[REG_B] = 0;
+  if (fd->state == STATE_BUSY) {
+    set_status(dcpu, fd, fd->state, ERROR_BUSY);
+  } else if (!fd->disk) {
+    set_status(dcpu, fd, fd->state, ERROR_NO_MEDIA);
+  } else if (writing && fd->ro) {
+    set_status(dcpu, fd, fd->state, ERROR_PROTECTED);
+  } else if (sector >= FD_TRACKS * FD_SECTORS) {
+    set_status(dcpu, fd, fd->state, ERROR_BAD_SECTOR);
+  } else {
+    fd->writing = writing;
+    fd->sector = sector;
+    fd->addr = dcpu->reg[REG_Y];
+    dcpu->reg[REG_B] = 1;
+
+    u16 track = sector / FD_SECTORS;
+    uint64_t tracks = track > fd->track ? track - fd->track : fd->track - track;
+    uint64_t ns = tracks * FD_SEEK_NS
+      + (uint64_t)FD_SECTOR_WORDS * 1000000000 / FD_WORDS_PER_S;
+    // fast drives still go busy and finish on the next cycle, so
+    // interrupt-driven code sees the same sequence of states.
+    fd->done = dcpu->cycles + (fd->fast ? 1 : ns / dcpu->tickns);
+    fd->track = track;
+    set_status(dcpu, fd, STATE_BUSY, ERROR_NONE);
+  }
+}
+
+static u16 floppy_hwi(dcpu *dcpu, device *dev) {
+  struct floppy_t *fd = dev->ctx;
+  switch (dcpu->reg[REG_A]) {
+    case 0: // poll device
+      dcpu->reg[REG_B] = fd->state;
+      dcpu->reg[REG_C] = fd->error;
+      fd->error = ERROR_NONE;
+      break;
+    case 1: // set interrupt
+      fd->msg = dcpu->reg[REG_X];
+      break;
+    case 2: // read sector
+      start(dcpu, fd, false);
+      break;
+    case 3: // write sector
+      start(dcpu, fd, true);
+      break;
+  }
+  return 0; // no extra cycles
+}
+
+static void floppy_tick(dcpu *dcpu, device *dev, tstamp_t now) {
+  (void)now;
+  struct floppy_t *fd = dev->ctx;
+  if (fd->state == STATE_BUSY && dcpu->cycles >= fd->done) {
+    transfer(dcpu, fd);
+    set_status(dcpu, fd, idle_state(fd), ERROR_NONE);
+  }
+}
+
+// the disk contents are saved in the image itself, of course. this is just
+// the drive.
+static size_t floppy_save(dcpu *dcpu, device *dev, void *buf, size_t len) {
+  struct floppy_t *fd = dev->ctx;
+  u16 busy = fd->state == STATE_BUSY;
+  uint64_t left = busy && fd->done > dcpu->cycles ? fd->done - dcpu->cycles : 0;
+  u16 words[] = {
+    fd->error, fd->msg, fd->track, busy, fd->writing, fd->sector, fd->addr,
+    left >> 16, left
+  };
+  if (len >= sizeof(words)) {
+    uint8_t *p = buf;
+    for (size_t i = 0; i < sizeof(words) / 2; i++) {
+      *p++ = words[i] >> 8;
+      *p++ = words[i];
+    }
+  }
+  return sizeof(words);
+}
+
+static bool floppy_restore(dcpu *dcpu, device *dev, const void *buf,
+    size_t len) {
+  struct floppy_t *fd = dev->ctx;
+  u16 words[9];
+  if (len != sizeof(words)) return false;
+  const uint8_t *p = buf;
+  for (size_t i = 0; i < sizeof(words) / 2; i++, p += 2)
+    words[i] = (p[0] << 8) | p[1];
+  fd->error = words[0];
+  fd->msg = words[1];
+  fd->track = words[2];
+  fd->writing = words[4];
+  fd->sector = words[5];
+  fd->addr = words[6];
+  fd->done = dcpu->cycles + (((uint64_t)words[7] << 16) | words[8]);
+  fd->state = words[3] && fd->disk ? STATE_BUSY : idle_state(fd);
+  return true;
+}
+
+static void floppy_kill(dcpu *dcpu, device *dev) {
+  (void)dcpu;
+  struct floppy_t *fd = dev->ctx;
+  if (fd->disk) {
+    if (!fd->ro) msync(fd->disk, FD_IMAGE_WORDS * 2, MS_SYNC);
+    munmap(fd->disk, FD_IMAGE_WORDS * 2);
+  }
+  free(fd);
+  dev->ctx = NULL;
+}
+
+// map an image, creating or extending it to full size if need be.
+static uint8_t *map_image(const char *path, bool ro) {
+  int fdesc = open(path, ro ? O_RDONLY : O_RDWR | O_CREAT, 0666);
+  if (fdesc < 0) return NULL;
+
+  struct stat st;
+  if (fstat(fdesc, &st)) goto fail;
+  if (st.st_size < FD_IMAGE_WORDS * 2) {
+    if (ro) {
+      errno = EINVAL;
+      goto fail;
+    }
+    if (ftruncate(fdesc, FD_IMAGE_WORDS * 2)) goto fail;
+  }
+
+  void *disk = mmap(NULL, FD_IMAGE_WORDS * 2,
+      ro ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, fdesc, 0);
+  if (disk == MAP_FAILED) goto fail;
+  close(fdesc); // the mapping keeps it alive
+  return disk;
+
+fail:
+  close(fdesc);
+  return NULL;
+}
+
+// args are path[:ro][:fast]. an empty path means no disk is inserted.
+bool dcpu_initfloppy(dcpu *dcpu, const char *args) {
+  struct floppy_t *fd = calloc(1, sizeof(*fd));
+  char *path = strdup(args);
+  char *opt = strchr(path, ':');
+  if (opt) *opt++ = '\0';
+  while (opt) {
+    char *next = strchr(opt, ':');
+    if (next) *next++ = '\0';
+    if (!strcmp(opt, "ro")) {
+      fd->ro = true;
+    } else if (!strcmp(opt, "fast")) {
+      fd->fast = true;
+    } else {
+      dcpu_exitmsg("unknown m35fd option '%s'\n", opt);
+      return false;
+    }
+    opt = next;
+  }
+  fd->path = path;
+
+  if (*path) {
+    fd->disk = map_image(path, fd->ro);
+    if (!fd->disk) {
+      dcpu_exitmsg("error mapping floppy image '%s': %s\n", path,
+          strerror(errno));
+      return false;
+    }
+  }
+  fd->state = idle_state(fd);
+  fd->error = ERROR_NONE;
+
+  // set up hardware descriptors
+  device *dev = dcpu_addhw(dcpu);
+  dev->id = 0x4fd524c5;
+  dev->version = 0x000b;
+  dev->mfr = 0x1eb37e91;
+  dev->hwi = &floppy_hwi;
+  dev->tick = &floppy_tick;
+  dev->save = &floppy_save;
+  dev->restore = &floppy_restore;
+  dev->kill = &floppy_kill;
+  dev->ctx = fd;
+  return true;
+}
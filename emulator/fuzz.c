@@ -0,0 +1,312 @@
+/*
+ * Copyright (c) 2012, Matt Hellige
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above copyright notice, 
+ *   this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above copyright 
+ *   notice, this list of conditions and the following disclaimer in the 
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR 
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT 
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, 
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY 
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/shm.h>
+
+#include "dcpu.h"
+
+// snapshot-and-reset fuzzing of guest programs through the keyboard. the
+// image is booted once, to a checkpoint: by default the first time it asks an
+// empty keyboard for a key, or after a given number of cycles. after that,
+// each input is typed in (as fast as the guest reads it) to a copy of the cpu
+// reset to the checkpoint, and run until the guest has read it all and asks
+// for more, halts, or runs out of cycles.
+//
+// resetting is cheap because it only copies back the pages of ram written
+// since the checkpoint, going by the DIRTY_FUZZ bit of the dirty map. the cpu
+// runs unpaced, with just a keyboard and a display that ignores everything,
+// so there's nothing else to reset.
+//
+// coverage is the pairs of consecutive pcs executed, hashed afl-style into a
+// map of FUZZ_MAP_SIZE hit counters. it's fed to afl through its shared
+// memory map, if __AFL_SHM_ID is set, or to libfuzzer as extra counters
+// when built as dcpufuzz (see the Makefile).
+
+#define FUZZ_MAP_SIZE 0x10000
+#define FUZZ_BOOT_CYCLES 100000000 // give up looking for a checkpoint
+
+static struct {
+  dcpu cpu;
+
+  // the checkpoint
+  struct dcpu_t snap;
+  u16 ram[RAM_WORDS];
+  u16 kbdints;
+
+  // the input being typed, and how much the guest has been told about
+  const uint8_t *input;
+  size_t len, pos, announced;
+  u16 kbdints_now;
+  bool starved; // the guest asked for a key when there were none left
+
+  uint64_t budget;
+  uint8_t *map;
+  uint64_t execs;
+  uint64_t cycles; // run, in total
+} fz;
+
+static u16 fuzz_kbd_hwi(dcpu *dcpu, device *dev) {
+  (void)dev;
+  switch (dcpu->reg[REG_A]) {
+    case 0: // clear buffer: the rest of the input is gone
+      fz.pos = fz.announced = fz.len;
+      break;
+    case 1: {
+      u16 c = 0;
+      if (fz.pos < fz.len) {
+        c = fz.input[fz.pos++];
+        // the same mapping the terminal does
+        if (c == '\n') c = 0x11;
+        else if (c == 0x7f) c = 0x10;
+      } else {
+        fz.starved = true;
+      }
+      dcpu->reg[REG_C] = c;
+      break;
+    }
+    case 2: // nothing is ever held down
+      dcpu->reg[REG_C] = 0;
+      break;
+    case 3:
+      fz.kbdints_now = dcpu->reg[REG_B];
+      break;
+  }
+  return 0;
+}
+
+// interrupt for one key at a time, once the guest has read the last one
+static void fuzz_kbd_tick(dcpu *dcpu, device *dev, tstamp_t now) {
+  (void)dev;
+  (void)now;
+  if (fz.kbdints_now && fz.announced == fz.pos && fz.pos < fz.len) {
+    fz.announced++;
+    dcpu_interrupt(dcpu, fz.kbdints_now);
+  }
+}
+
+static u16 fuzz_lem_hwi(dcpu *dcpu, device *dev) {
+  (void)dcpu;
+  (void)dev;
+  return 0;
+}
+
+static void add_devices(dcpu *dcpu) {
+  device *kbd = dcpu_addhw(dcpu);
+  kbd->id = 0x30cf7406;
+  kbd->version = 1;
+  kbd->mfr = 0x01220423;
+  kbd->hwi = &fuzz_kbd_hwi;
+  kbd->tick = &fuzz_kbd_tick;
+
+  device *lem = dcpu_addhw(dcpu);
+  lem->id = 0x7349f615;
+  lem->version = 0x1802;
+  lem->mfr = 0x1c6c8b36;
+  lem->hwi = &fuzz_lem_hwi;
+}
+
+// run until the guest wants more input than there is, halts, or hits limit
+static void run(uint64_t limit, bool cover) {
+  dcpu *dcpu = &fz.cpu;
+  u16 prev = 0;
+  fz.starved = false;
+  while (!fz.starved && dcpu->cycles < limit) {
+    u16 pc = dcpu->pc;
+    if (cover) {
+      uint8_t *hit = &fz.map[(pc ^ prev) % FUZZ_MAP_SIZE];
+      if (*hit != 0xff) (*hit)++;
+      prev = pc >> 1;
+    }
+    // like batch mode, a single-instruction loop counts as a halt
+    if (dcpu_step(dcpu) != A_CONTINUE || dcpu->pc == pc) break;
+  }
+}
+
+static void checkpoint(void) {
+  dcpu *dcpu = &fz.cpu;
+  fz.snap = *dcpu;
+  memcpy(fz.ram, dcpu->ram, sizeof(fz.ram));
+  fz.kbdints = fz.kbdints_now;
+  for (int i = 0; i < DIRTY_PAGES; i++) dcpu->dirty[i] &= ~DIRTY_FUZZ;
+}
+
+static void reset(void) {
+  dcpu *dcpu = &fz.cpu;
+  for (int i = 0; i < DIRTY_PAGES; i++) {
+    if (!(dcpu->dirty[i] & DIRTY_FUZZ)) continue;
+    memcpy(dcpu->ram + (i << DIRTY_SHIFT), fz.ram + (i << DIRTY_SHIFT),
+        sizeof(u16) << DIRTY_SHIFT);
+    dcpu->dirty[i] &= ~DIRTY_FUZZ;
+  }
+  dcpu->cycles = fz.snap.cycles;
+  dcpu->pc = fz.snap.pc;
+  dcpu->sp = fz.snap.sp;
+  dcpu->ex = fz.snap.ex;
+  dcpu->ia = fz.snap.ia;
+  memcpy(dcpu->reg, fz.snap.reg, sizeof(dcpu->reg));
+  dcpu->qints = fz.snap.qints;
+  memcpy(dcpu->intq, fz.snap.intq, sizeof(dcpu->intq));
+  dcpu->intqread = fz.snap.intqread;
+  dcpu->intqwrite = fz.snap.intqwrite;
+  fz.kbdints_now = fz.kbdints;
+}
+
+// boot image to the checkpoint: after at cycles, or when it first asks for a
+// key if at is 0. each input then gets up to budget cycles.
+bool dcpu_fuzzinit(const char *image, bool bigend, uint64_t at,
+    uint64_t budget) {
+  dcpu *dcpu = &fz.cpu;
+  dcpu_init(dcpu, 1);
+  dcpu->unpaced = true;
+  if (!dcpu_loadcore(dcpu, image, bigend)) return false;
+  add_devices(dcpu);
+
+  fz.map = calloc(FUZZ_MAP_SIZE, 1);
+  fz.budget = budget;
+  fz.input = NULL;
+  fz.len = fz.pos = fz.announced = 0;
+  run(at ? at : FUZZ_BOOT_CYCLES, false);
+  if (!at && !fz.starved) {
+    dcpu_exitmsg("'%s' never asked for a key\n", image);
+    return false;
+  }
+  dcpu_msg("checkpoint at cycle %" PRIu64 ", pc 0x%04x\n", dcpu->cycles,
+      dcpu->pc);
+  checkpoint();
+  return true;
+}
+
+// use map (FUZZ_MAP_SIZE bytes) for coverage from now on, e.g. a fuzzer's
+void dcpu_fuzzmap(uint8_t *map) {
+  free(fz.map);
+  fz.map = map;
+}
+
+// run one input from the checkpoint, adding its coverage to the map
+void dcpu_fuzzone(const uint8_t *data, size_t len) {
+  reset();
+  fz.input = data;
+  fz.len = len;
+  fz.pos = fz.announced = 0;
+  run(fz.snap.cycles + fz.budget, true);
+  fz.execs++;
+  fz.cycles += fz.cpu.cycles - fz.snap.cycles;
+}
+
+// how many entries of the map have been hit, since it was last cleared
+unsigned dcpu_fuzzcoverage(void) {
+  unsigned n = 0;
+  for (int i = 0; i < FUZZ_MAP_SIZE; i++) n += !!fz.map[i];
+  return n;
+}
+
+static uint8_t *read_file(FILE *f, size_t *len) {
+  size_t cap = 4096;
+  uint8_t *buf = malloc(cap);
+  *len = 0;
+  size_t n;
+  while ((n = fread(buf + *len, 1, cap - *len, f)) > 0) {
+    *len += n;
+    if (*len == cap) buf = realloc(buf, cap *= 2);
+  }
+  return buf;
+}
+
+// the driver behind --fuzz: run each of the given input files (or stdin, if
+// there are none), writing coverage to afl's map if there is one, and report.
+int dcpu_fuzzmain(int ninputs, char **inputs) {
+  const char *shm = getenv("__AFL_SHM_ID");
+  if (shm) {
+    void *map = shmat(atoi(shm), NULL, 0);
+    if (map == (void *)-1) {
+      dcpu_exitmsg("can't attach to afl's coverage map\n");
+      return 1;
+    }
+    dcpu_fuzzmap(map);
+  }
+
+  tstamp_t start = dcpu_now();
+  for (int i = 0; i < (ninputs ? ninputs : 1); i++) {
+    FILE *f = ninputs ? fopen(inputs[i], "r") : stdin;
+    if (!f) {
+      dcpu_exitmsg("error reading input '%s'\n", inputs[i]);
+      return 1;
+    }
+    size_t len;
+    uint8_t *data = read_file(f, &len);
+    if (ninputs) fclose(f);
+    dcpu_fuzzone(data, len);
+    free(data);
+  }
+
+  if (!shm) {
+    double secs = (dcpu_now() - start) / 1e9;
+    fprintf(stderr, "%" PRIu64 " inputs in %.3fs (%.0f/s, %" PRIu64
+        " cycles each), %u edges covered\n", fz.execs, secs, fz.execs / secs,
+        fz.execs ? fz.cycles / fz.execs : 0, dcpu_fuzzcoverage());
+  }
+  return 0;
+}
+
+#ifdef DCPU_LIBFUZZER
+// the libfuzzer entry points, for dcpufuzz. it has no main of its own, so the
+// image and limits come from the environment: DCPU_FUZZ_IMAGE (default
+// goforth.img), DCPU_FUZZ_CHECKPOINT and DCPU_FUZZ_CYCLES.
+
+volatile bool dcpu_break = false;
+volatile bool dcpu_die = false;
+
+// libfuzzer picks these up as coverage, alongside its own
+static uint8_t counters[FUZZ_MAP_SIZE]
+  __attribute__((section("__libfuzzer_extra_counters")));
+
+static uint64_t env(const char *name, uint64_t dflt) {
+  const char *val = getenv(name);
+  return val ? strtoull(val, NULL, 0) : dflt;
+}
+
+int LLVMFuzzerInitialize(int *argc, char ***argv) {
+  (void)argc;
+  (void)argv;
+  const char *image = getenv("DCPU_FUZZ_IMAGE");
+  dcpu_initops();
+  dcpu_initlog("-", L_WARN);
+  if (!dcpu_fuzzinit(image ? image : "goforth.img", true,
+        env("DCPU_FUZZ_CHECKPOINT", 0), env("DCPU_FUZZ_CYCLES", 1000000)))
+    exit(1);
+  dcpu_fuzzmap(counters);
+  return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t len) {
+  dcpu_fuzzone(data, len);
+  return 0;
+}
+#endif
@@ -0,0 +1,325 @@
+/*
+ * Copyright (c) 2012, Matt Hellige
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above copyright notice, 
+ *   this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above copyright 
+ *   notice, this list of conditions and the following disclaimer in the 
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR 
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT 
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, 
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY 
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include "lem.h"
+
+#include "font.xbm"
+
+#define FRESH 0x4 // set in middle when it holds a frame the renderer hasn't seen
+
+// default palette
+const u16 lem_palette[16] = {
+    0x0000, 0x000a, 0x00a0, 0x00aa,
+    0x0a00, 0x0a0a, 0x0a50, 0x0aaa,
+    0x0555, 0x055f, 0x05f5, 0x05ff,
+    0x0f55, 0x0f5f, 0x0ff5, 0x0fff};
+
+// default font
+u16 lem_font[256];
+
+static uint8_t font_pixel(int n) {
+  return ((font_bits[n/8] >> n%8) & 1) ^ 1;
+}
+
+void lem_initfont(void) {
+  static bool ready = false;
+  if (ready) return;
+  ready = true;
+
+  // initialize font from xbm
+  int w = font_width;
+  for (int j = 0; j < font_height; j += 8) {
+    for (int i = 0; i < w; i += 2) {
+      int idx = j*w + i;
+      u16 ch = 0;
+      for (int k = 0; k < 8; k++) {
+        ch |= font_pixel(idx   + k*w) << (k+8);
+        ch |= font_pixel(idx+1 + k*w) << k;
+      }
+      lem_font[i/2 + j*w/16] = ch;
+    }
+  }
+}
+
+void lem_init(lem_display *lem) {
+  lem_initfont();
+
+  lem->regs = (lem_regs) { 0, 0, 0, 0 };
+  lem->published = lem->regs;
+  lem->force = true;
+  lem->tickns = 1000000000 / DISPLAY_HZ;
+  lem->nexttick = dcpu_now();
+  for (int i = 0; i < 3; i++) {
+    lem->frames[i].regs = lem->regs;
+    for (int j = 0; j < SCR_HEIGHT * SCR_WIDTH; j++)
+      lem->frames[i].vram[j] = 0;
+    for (int j = 0; j < 256; j++) lem->frames[i].font[j] = lem_font[j];
+    for (int j = 0; j < 16; j++) lem->frames[i].palette[j] = lem_palette[j];
+  }
+  lem->back = 0;
+  lem->middle = 1;
+  lem->front = 2;
+  lem->backend = NULL;
+  lem->running = false;
+  lem->quit = false;
+}
+
+// the full lem1802 hwi, for backends that support everything
+u16 lem_runhwi(lem_regs *regs, dcpu *dcpu) {
+  switch (dcpu->reg[REG_A]) {
+    case 0: // MEM_MAP_SCREEN
+      regs->vram = dcpu->reg[REG_B];
+      break;
+    case 1: // MEM_MAP_FONT
+      regs->fontram = dcpu->reg[REG_B];
+      break;
+    case 2: // MEM_MAP_PALETTE
+      regs->palram = dcpu->reg[REG_B];
+      break;
+    case 3: // SET_BORDER_COLOR
+      regs->border = dcpu->reg[REG_B] & 0xf;
+      break;
+    case 4: { // MEM_DUMP_FONT
+      u16 addr = dcpu->reg[REG_B];
+      for (int i = 0; i < 256; i++)
+        dcpu_write(dcpu, addr++, lem_font[i]);
+      return 256; // halts for 256 extra cycles
+    }
+    case 5: { // MEM_DUMP_PALETTE
+      u16 addr = dcpu->reg[REG_B];
+      for (int i = 0; i < 16; i++)
+        dcpu_write(dcpu, addr++, lem_palette[i]);
+      return 16; // halts for 16 extra cycles
+    }
+  }
+  return 0; // no extra cycles
+}
+
+// save and restore hooks for the registers, for every backend's device
+#define LEM_STATE_LEN 8
+
+size_t lem_saveregs(const lem_regs *regs, void *buf, size_t len) {
+  uint8_t *p = buf;
+  if (len >= LEM_STATE_LEN) {
+    u16 words[] = { regs->vram, regs->fontram, regs->palram, regs->border };
+    for (int i = 0; i < 4; i++) {
+      *p++ = words[i] >> 8;
+      *p++ = words[i];
+    }
+  }
+  return LEM_STATE_LEN;
+}
+
+bool lem_restoreregs(lem_regs *regs, const void *buf, size_t len) {
+  const uint8_t *p = buf;
+  if (len != LEM_STATE_LEN) return false;
+  regs->vram = (p[0] << 8) | p[1];
+  regs->fontram = (p[2] << 8) | p[3];
+  regs->palram = (p[4] << 8) | p[5];
+  regs->border = ((p[6] << 8) | p[7]) & 0xf;
+  return true;
+}
+
+// convert a palette entry to 0xrrggbb by duplicating each nibble
+uint32_t lem_rgb(u16 col) {
+  uint32_t r = (col & 0x0f00) >> 8; r |= r << 4;
+  uint32_t g = (col & 0x00f0) >> 4; g |= g << 4;
+  uint32_t b = (col & 0x000f);      b |= b << 4;
+  return (r << 16) | (g << 8) | b;
+}
+
+// the two font words of the glyph for a cell, or blank if it's blinked out
+uint32_t lem_glyph(const lem_frame *frame, u16 word, bool blinkon) {
+  if ((word & 0x80) && !blinkon) return 0;
+  u16 charidx = word & 0x7f;
+  return (frame->font[charidx*2] << 16) | frame->font[charidx*2 + 1];
+}
+
+// rasterize one cell into a 32bpp buffer. each byte of the glyph is one
+// column, with the top row in the low bit. we expand one scaled pixel row at
+// a time, then copy it down for the rest of the scaled rows.
+void lem_drawcell(uint8_t *base, int pitch, int scale, uint32_t glyph,
+    uint32_t fg, uint32_t bg) {
+  for (int y = 0; y < 8; y++) {
+    uint8_t *line = base + y * scale * pitch;
+    uint32_t *pix = (uint32_t *)line;
+    for (int x = 0; x < 4; x++) {
+      uint32_t on = -((glyph >> (8 * (3-x) + y)) & 1);
+      uint32_t px = (fg & on) | (bg & ~on);
+      for (int s = 0; s < scale; s++)
+        *pix++ = px;
+    }
+    for (int s = 1; s < scale; s++)
+      memcpy(line + s * pitch, line, 4 * scale * sizeof(uint32_t));
+  }
+}
+
+// copy n words starting at addr, wrapping around the end of ram
+static void copy_ram(dcpu *dcpu, u16 *dst, u16 addr, int n) {
+  for (int i = 0; i < n; i++)
+    dst[i] = dcpu->ram[addr++];
+}
+
+void lem_snapshot(dcpu *dcpu, const lem_regs *regs, lem_frame *frame) {
+  frame->regs = *regs;
+  if (regs->vram)
+    copy_ram(dcpu, frame->vram, regs->vram, SCR_HEIGHT * SCR_WIDTH);
+  if (regs->fontram) copy_ram(dcpu, frame->font, regs->fontram, 256);
+  else for (int i = 0; i < 256; i++) frame->font[i] = lem_font[i];
+  if (regs->palram) copy_ram(dcpu, frame->palette, regs->palram, 16);
+  else for (int i = 0; i < 16; i++) frame->palette[i] = lem_palette[i];
+}
+
+// check (and clear) the video dirty bit of every page overlapping a range
+static bool dirty_range(dcpu *dcpu, u16 addr, int n) {
+  u16 page = addr >> DIRTY_SHIFT;
+  int npages = ((addr & ((1 << DIRTY_SHIFT) - 1)) + n
+      + (1 << DIRTY_SHIFT) - 1) >> DIRTY_SHIFT;
+  bool dirty = false;
+  for (int i = 0; i < npages; i++, page = (page + 1) % DIRTY_PAGES) {
+    dirty |= dcpu->dirty[page] & DIRTY_VIDEO;
+    dcpu->dirty[page] &= ~DIRTY_VIDEO;
+  }
+  return dirty;
+}
+
+// take a snapshot of video state and hand it to the render thread. unless
+// forced, this does nothing when no mapped memory has been written and no
+// registers have changed since the last frame, so the render thread can
+// sleep through idle screens.
+void lem_publish(lem_display *lem, dcpu *dcpu, bool force) {
+  lem_regs *r = &lem->regs;
+  bool changed = force || lem->force
+      || r->vram != lem->published.vram
+      || r->fontram != lem->published.fontram
+      || r->palram != lem->published.palram
+      || r->border != lem->published.border;
+  // careful to check every range, so that all the dirty bits get cleared.
+  if (r->vram) changed |= dirty_range(dcpu, r->vram, SCR_HEIGHT * SCR_WIDTH);
+  if (r->fontram) changed |= dirty_range(dcpu, r->fontram, 256);
+  if (r->palram) changed |= dirty_range(dcpu, r->palram, 16);
+  if (!changed) return;
+
+  lem_snapshot(dcpu, r, &lem->frames[lem->back]);
+  lem->back = __atomic_exchange_n(&lem->middle, lem->back | FRESH,
+      __ATOMIC_ACQ_REL) & ~FRESH;
+  lem->published = *r;
+  lem->force = false;
+}
+
+void lem_update(lem_display *lem, dcpu *dcpu, tstamp_t now) {
+  if (now > lem->nexttick) {
+    lem_publish(lem, dcpu, false);
+    lem->nexttick += lem->tickns;
+  }
+}
+
+struct startup_t {
+  lem_display *lem;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool done;
+  bool ok;
+};
+
+static void *render_loop(void *arg) {
+  struct startup_t *startup = arg;
+  lem_display *lem = startup->lem;
+  const lem_backend *backend = lem->backend;
+
+  bool ok = !backend->init || backend->init();
+  pthread_mutex_lock(&startup->lock);
+  startup->ok = ok;
+  startup->done = true;
+  pthread_cond_signal(&startup->cond);
+  pthread_mutex_unlock(&startup->lock);
+  // startup is gone as soon as we let go of it...
+  if (!ok) return NULL;
+
+  tstamp_t next = dcpu_now();
+  while (!__atomic_load_n(&lem->quit, __ATOMIC_ACQUIRE)) {
+    bool fresh = false;
+    if (__atomic_load_n(&lem->middle, __ATOMIC_ACQUIRE) & FRESH) {
+      lem->front = __atomic_exchange_n(&lem->middle, lem->front,
+          __ATOMIC_ACQ_REL) & ~FRESH;
+      fresh = true;
+    }
+    tstamp_t now = dcpu_now();
+    backend->render(&lem->frames[lem->front], fresh, now);
+
+    // if we've fallen way behind, don't try to catch up
+    next += lem->tickns;
+    now = dcpu_now();
+    if (now > next + lem->tickns) next = now;
+    if (now < next) {
+      struct timespec ts = { 0, next - now };
+      nanosleep(&ts, NULL);
+    }
+  }
+
+  if (backend->kill) backend->kill();
+  return NULL;
+}
+
+// start the render thread, and wait for the backend to initialize.
+bool lem_start(lem_display *lem, const lem_backend *backend) {
+  struct startup_t startup;
+  startup.lem = lem;
+  pthread_mutex_init(&startup.lock, NULL);
+  pthread_cond_init(&startup.cond, NULL);
+  startup.done = false;
+  startup.ok = false;
+
+  lem->backend = backend;
+  lem->quit = false;
+  if (pthread_create(&lem->thread, NULL, render_loop, &startup))
+    return false;
+
+  pthread_mutex_lock(&startup.lock);
+  while (!startup.done)
+    pthread_cond_wait(&startup.cond, &startup.lock);
+  pthread_mutex_unlock(&startup.lock);
+  pthread_mutex_destroy(&startup.lock);
+  pthread_cond_destroy(&startup.cond);
+
+  if (!startup.ok) {
+    pthread_join(lem->thread, NULL);
+    return false;
+  }
+  lem->running = true;
+  return true;
+}
+
+void lem_stop(lem_display *lem) {
+  if (!lem->running) return;
+  __atomic_store_n(&lem->quit, true, __ATOMIC_RELEASE);
+  pthread_join(lem->thread, NULL);
+  lem->running = false;
+}
@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2012, Matt Hellige
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above copyright notice, 
+ *   this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above copyright 
+ *   notice, this list of conditions and the following disclaimer in the 
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR 
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT 
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, 
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY 
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef lem_h
+#define lem_h
+
+#include <pthread.h>
+
+#include "dcpu.h"
+
+
+#define LEM_WIDTH   (SCR_WIDTH * 4 + 2 * SCR_BORDER)
+#define LEM_HEIGHT  (SCR_HEIGHT * 8 + 2 * SCR_BORDER)
+
+// the state of a lem1802, as set by its hwis. 0 means unmapped.
+typedef struct lem_regs_t {
+  u16 vram;
+  u16 fontram;
+  u16 palram;
+  u16 border;
+} lem_regs;
+
+// a consistent snapshot of everything the display needs to draw one frame.
+// font and palette always hold the effective values, i.e., the defaults when
+// unmapped.
+typedef struct lem_frame_t {
+  lem_regs regs;
+  u16 vram[SCR_HEIGHT * SCR_WIDTH];
+  u16 font[256];
+  u16 palette[16];
+} lem_frame;
+
+// callbacks run on the render thread. render is called DISPLAY_HZ times a
+// second, whether or not a new frame has arrived.
+typedef struct lem_backend_t {
+  bool (*init)(void);
+  void (*render)(const lem_frame *frame, bool fresh, tstamp_t now);
+  void (*kill)(void);
+} lem_backend;
+
+// frames are handed from the emulator thread to the render thread through a
+// lock-free triple buffer: the emulator owns back, the renderer owns front,
+// and they swap with middle atomically. neither side ever waits for the
+// other.
+typedef struct lem_display_t {
+  lem_regs regs; // live registers, written by the hwi
+  lem_regs published;
+  bool force;
+  tstamp_t tickns;
+  tstamp_t nexttick;
+
+  lem_frame frames[3];
+  int back;
+  int front;
+  int middle;
+
+  const lem_backend *backend;
+  pthread_t thread;
+  bool running;
+  bool quit;
+} lem_display;
+
+extern const u16 lem_palette[16];
+extern u16 lem_font[256];
+
+extern void lem_initfont(void);
+extern u16 lem_runhwi(lem_regs *regs, dcpu *dcpu);
+extern size_t lem_saveregs(const lem_regs *regs, void *buf, size_t len);
+extern bool lem_restoreregs(lem_regs *regs, const void *buf, size_t len);
+extern uint32_t lem_rgb(u16 col);
+extern uint32_t lem_glyph(const lem_frame *frame, u16 word, bool blinkon);
+extern void lem_drawcell(uint8_t *base, int pitch, int scale, uint32_t glyph,
+    uint32_t fg, uint32_t bg);
+extern void lem_snapshot(dcpu *dcpu, const lem_regs *regs, lem_frame *frame);
+
+extern void lem_init(lem_display *lem);
+extern bool lem_start(lem_display *lem, const lem_backend *backend);
+extern void lem_stop(lem_display *lem);
+extern void lem_publish(lem_display *lem, dcpu *dcpu, bool force);
+extern void lem_update(lem_display *lem, dcpu *dcpu, tstamp_t now);
+
+
+#endif
@@ -0,0 +1,290 @@
+/*
+ * Copyright (c) 2012, Matt Hellige
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above copyright notice, 
+ *   this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above copyright 
+ *   notice, this list of conditions and the following disclaimer in the 
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR 
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT 
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, 
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY 
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "dcpu.h"
+
+// messages are formatted into a ring by whoever logs them, and written out
+// in batches by a flusher thread, so that logging never costs the emulator a
+// terminal refresh. while the debugger owns the terminal we switch to
+// synchronous mode: nothing is rate-limited or dropped, and the log is flushed
+// before the debugger reads each command.
+
+#define LOG_SLOTS  256
+#define LOG_LINE   160
+#define FLUSH_NS   50000000 // 20Hz
+
+struct bucket_t {
+  uint32_t rate;  // tokens per second, or 0 for unlimited
+  uint32_t burst;
+  uint64_t tokens; // scaled by 1e9, to avoid any division
+  tstamp_t last;
+  uint32_t suppressed;
+};
+
+struct log_t {
+  pthread_mutex_t lock; // protects everything down to sync
+  pthread_cond_t wake;
+  char lines[LOG_SLOTS][LOG_LINE];
+  bool console[LOG_SLOTS]; // logged from the debugger, so it goes to curses
+  unsigned write;
+  unsigned read;
+  uint32_t dropped;
+  struct bucket_t buckets[L_NLEVELS];
+  loglevel_t level;
+  bool sync;
+  bool debugging; // the debugger's own output is never filtered by level
+
+  pthread_mutex_t flushlock; // serializes writes to the sink
+  FILE *sink; // or NULL for the curses window
+  pthread_t flusher;
+  bool running;
+  bool quit;
+};
+
+static struct log_t logger = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .wake = PTHREAD_COND_INITIALIZER,
+  .flushlock = PTHREAD_MUTEX_INITIALIZER,
+  .buckets = {
+    [L_DEBUG] = { 50, 100, 100 * 1000000000ull, 0, 0 },
+    [L_INFO]  = { 0, 0, 0, 0, 0 },
+    [L_WARN]  = { 10, 20, 20 * 1000000000ull, 0, 0 },
+    [L_ERROR] = { 0, 0, 0, 0, 0 },
+  },
+  .level = L_INFO,
+  .sync = true,
+};
+
+static const char *level_names[L_NLEVELS] = {
+  "debug", "info", "warning", "error"
+};
+
+// write out everything in the ring. call holding flushlock, not lock.
+static void flush(void) {
+  static char batch[LOG_SLOTS][LOG_LINE];
+  static const char *lines[LOG_SLOTS + 1];
+  static const char *console[LOG_SLOTS];
+  static char dropmsg[LOG_LINE];
+
+  // without a separate sink, everything goes to the curses window anyway
+  pthread_mutex_lock(&logger.lock);
+  int n = 0, nconsole = 0;
+  for (int i = 0; logger.read != logger.write; logger.read++, i++) {
+    int idx = logger.read % LOG_SLOTS;
+    memcpy(batch[i], logger.lines[idx], LOG_LINE);
+    if (logger.sink && logger.console[idx]) console[nconsole++] = batch[i];
+    else lines[n++] = batch[i];
+  }
+  uint32_t dropped = logger.dropped;
+  logger.dropped = 0;
+  pthread_mutex_unlock(&logger.lock);
+
+  if (dropped) {
+    snprintf(dropmsg, sizeof(dropmsg),
+        "(log overflow: %u messages dropped)\n", dropped);
+    lines[n++] = dropmsg;
+  }
+
+  if (nconsole) dcpu_termwrite(console, nconsole);
+  if (!n) return;
+  if (logger.sink) {
+    for (int i = 0; i < n; i++) fputs(lines[i], logger.sink);
+    fflush(logger.sink);
+  } else {
+    dcpu_termwrite(lines, n);
+  }
+}
+
+void dcpu_flushlog(void) {
+  pthread_mutex_lock(&logger.flushlock);
+  flush();
+  pthread_mutex_unlock(&logger.flushlock);
+}
+
+static void *flush_loop(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&logger.lock);
+  while (!logger.quit) {
+    if (logger.read == logger.write && !logger.dropped) {
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_nsec += FLUSH_NS;
+      if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&logger.wake, &logger.lock, &ts);
+      continue;
+    }
+    pthread_mutex_unlock(&logger.lock);
+    dcpu_flushlog();
+    // batch up whatever arrives in the meantime
+    struct timespec ts = { 0, FLUSH_NS };
+    nanosleep(&ts, NULL);
+    pthread_mutex_lock(&logger.lock);
+  }
+  pthread_mutex_unlock(&logger.lock);
+  return NULL;
+}
+
+// take a token from the level's bucket. call holding lock.
+static bool allow(loglevel_t level) {
+  struct bucket_t *b = &logger.buckets[level];
+  if (!b->rate || logger.sync) return true;
+  tstamp_t now = dcpu_now();
+  uint64_t cap = (uint64_t)b->burst * 1000000000ull;
+  uint64_t refill = (now - b->last) * b->rate;
+  b->tokens = refill >= cap - b->tokens ? cap : b->tokens + refill;
+  b->last = now;
+  if (b->tokens < 1000000000ull) {
+    b->suppressed++;
+    return false;
+  }
+  b->tokens -= 1000000000ull;
+  return true;
+}
+
+// claim the next slot, or NULL if the ring is full. call holding lock.
+static char *slot(void) {
+  if (logger.write - logger.read >= LOG_SLOTS) {
+    if (!logger.sync) {
+      logger.dropped++;
+      return NULL;
+    }
+    // nothing may be lost while debugging, so make room.
+    pthread_mutex_unlock(&logger.lock);
+    dcpu_flushlog();
+    pthread_mutex_lock(&logger.lock);
+  }
+  logger.console[logger.write % LOG_SLOTS] = logger.sync;
+  return logger.lines[logger.write++ % LOG_SLOTS];
+}
+
+static void vlog(loglevel_t level, char *fmt, va_list args) {
+  if (level < logger.level
+      && !__atomic_load_n(&logger.debugging, __ATOMIC_RELAXED))
+    return;
+  pthread_mutex_lock(&logger.lock);
+  if (!allow(level)) {
+    pthread_mutex_unlock(&logger.lock);
+    return;
+  }
+
+  struct bucket_t *b = &logger.buckets[level];
+  if (b->suppressed) {
+    char *line = slot();
+    if (line)
+      snprintf(line, LOG_LINE, "(%u %s messages suppressed)\n",
+          b->suppressed, level_names[level]);
+    b->suppressed = 0;
+  }
+  char *line = slot();
+  if (line) vsnprintf(line, LOG_LINE, fmt, args);
+  bool urgent = level >= L_ERROR
+      || logger.write - logger.read >= LOG_SLOTS / 2;
+  pthread_mutex_unlock(&logger.lock);
+  if (urgent) pthread_cond_signal(&logger.wake);
+}
+
+void dcpu_log(loglevel_t level, char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  vlog(level, fmt, args);
+  va_end(args);
+}
+
+void dcpu_msg(char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  vlog(L_INFO, fmt, args);
+  va_end(args);
+}
+
+// entering the debugger makes the log synchronous, and leaving it makes it
+// asynchronous (and rate limited) again. --log-level doesn't apply in between,
+// or it would hide the debugger's output.
+void dcpu_logsync(bool sync) {
+  pthread_mutex_lock(&logger.lock);
+  logger.sync = sync;
+  __atomic_store_n(&logger.debugging, sync, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&logger.lock);
+  if (sync) dcpu_flushlog();
+}
+
+bool dcpu_parseloglevel(const char *name, loglevel_t *level) {
+  for (int i = 0; i < L_NLEVELS; i++) {
+    if (!strcmp(name, level_names[i])
+        || (i == L_WARN && !strcmp(name, "warn"))) {
+      *level = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+// path is a file to log to, "-" for stderr, or NULL for the curses window.
+bool dcpu_initlog(const char *path, loglevel_t level) {
+  logger.level = level;
+  if (path && !strcmp(path, "-")) {
+    logger.sink = stderr;
+  } else if (path) {
+    logger.sink = fopen(path, "a");
+    if (!logger.sink) {
+      dcpu_exitmsg("error opening log '%s': %s\n", path, strerror(errno));
+      return false;
+    }
+  }
+
+  logger.quit = false;
+  if (pthread_create(&logger.flusher, NULL, &flush_loop, NULL)) {
+    dcpu_exitmsg("unable to start log thread\n");
+    return false;
+  }
+  logger.running = true;
+  return true;
+}
+
+void dcpu_killlog(void) {
+  if (logger.running) {
+    pthread_mutex_lock(&logger.lock);
+    logger.quit = true;
+    pthread_cond_signal(&logger.wake);
+    pthread_mutex_unlock(&logger.lock);
+    pthread_join(logger.flusher, NULL);
+    logger.running = false;
+  }
+  dcpu_flushlog();
+  if (logger.sink && logger.sink != stderr) fclose(logger.sink);
+  logger.sink = NULL;
+}
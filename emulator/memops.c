@@ -0,0 +1,194 @@
+/*
+ * Copyright (c) 2012, Matt Hellige
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above copyright notice, 
+ *   this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above copyright 
+ *   notice, this list of conditions and the following disclaimer in the 
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR 
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT 
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, 
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY 
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "dcpu.h"
+
+// host-accelerated memory operations. the guest describes a bulk operation in
+// registers and the device does it at host speed with memmove and friends,
+// returning a fixed cost in cycles so timing stays deterministic:
+//
+//   base + count / rate
+//
+// where base and rate (words per cycle) are set with --device
+// memops[:base=N][:rate=N]. a rate of 0 makes the per-word cost free.
+// addresses wrap around the end of ram, like everything else.
+//
+// interrupts:
+//
+//   A=0: move Z words from Y to X. the ranges may overlap.
+//   A=1: fill Z words at X with the value Y.
+//   A=2: search Y words at X for the I-word pattern at Z. on a match B is
+//        set to its address and C to 1, otherwise B=0xffff and C=0.
+//   A=3: checksum Y words at X, setting B:C to their fletcher-32 sum.
+
+struct memops_t {
+  unsigned base;
+  unsigned rate;
+};
+
+static u16 tmp[RAM_WORDS], pat[RAM_WORDS];
+
+// how many of n words starting at addr come before the end of ram
+static unsigned before_wrap(u16 addr, unsigned n) {
+  unsigned left = RAM_WORDS - (unsigned)addr;
+  return left < n ? left : n;
+}
+
+static void read_ram(dcpu *dcpu, u16 *dst, u16 addr, unsigned n) {
+  unsigned first = before_wrap(addr, n);
+  memcpy(dst, dcpu->ram + addr, first * sizeof(u16));
+  memcpy(dst + first, dcpu->ram, (n - first) * sizeof(u16));
+}
+
+static void touch_range(dcpu *dcpu, u16 addr, unsigned n) {
+  if (!n) return;
+  unsigned last = (addr + n - 1) >> DIRTY_SHIFT;
+  for (unsigned p = addr >> DIRTY_SHIFT; p <= last; p++)
+    dcpu->dirty[p % DIRTY_PAGES] = 0xff;
+}
+
+static void write_ram(dcpu *dcpu, u16 addr, const u16 *src, unsigned n) {
+  unsigned first = before_wrap(addr, n);
+  memcpy(dcpu->ram + addr, src, first * sizeof(u16));
+  memcpy(dcpu->ram, src + first, (n - first) * sizeof(u16));
+  touch_range(dcpu, addr, n);
+}
+
+static void fill(dcpu *dcpu, u16 addr, u16 val, unsigned n) {
+  unsigned first = before_wrap(addr, n);
+  for (unsigned i = 0; i < first; i++) dcpu->ram[addr + i] = val;
+  for (unsigned i = 0; i < n - first; i++) dcpu->ram[i] = val;
+  touch_range(dcpu, addr, n);
+}
+
+static void search(dcpu *dcpu, u16 addr, unsigned n, u16 paddr,
+    unsigned plen) {
+  dcpu->reg[REG_B] = 0xffff;
+  dcpu->reg[REG_C] = 0;
+  if (plen > n) return;
+  read_ram(dcpu, tmp, addr, n);
+  read_ram(dcpu, pat, paddr, plen);
+  for (unsigned i = 0; i <= n - plen; i++) {
+    if ((!plen || tmp[i] == pat[0])
+        && !memcmp(tmp + i, pat, plen * sizeof(u16))) {
+      dcpu->reg[REG_B] = addr + i;
+      dcpu->reg[REG_C] = 1;
+      return;
+    }
+  }
+}
+
+static void checksum(dcpu *dcpu, u16 addr, unsigned n) {
+  read_ram(dcpu, tmp, addr, n);
+  uint32_t a = 0xffff, b = 0xffff;
+  for (unsigned i = 0; i < n; ) {
+    // 359 words is as many as can be summed before b overflows
+    unsigned end = n - i > 359 ? i + 359 : n;
+    for (; i < end; i++) {
+      a += tmp[i];
+      b += a;
+    }
+    a = (a & 0xffff) + (a >> 16);
+    b = (b & 0xffff) + (b >> 16);
+  }
+  a = (a & 0xffff) + (a >> 16);
+  b = (b & 0xffff) + (b >> 16);
+  dcpu->reg[REG_B] = b;
+  dcpu->reg[REG_C] = a;
+}
+
+static u16 memops_hwi(dcpu *dcpu, device *dev) {
+  struct memops_t *m = dev->ctx;
+  u16 x = dcpu->reg[REG_X], y = dcpu->reg[REG_Y], z = dcpu->reg[REG_Z];
+  unsigned count = 0;
+  switch (dcpu->reg[REG_A]) {
+    case 0: // move
+      read_ram(dcpu, tmp, y, z);
+      write_ram(dcpu, x, tmp, z);
+      count = z;
+      break;
+    case 1: // fill
+      fill(dcpu, x, y, z);
+      count = z;
+      break;
+    case 2: // search
+      search(dcpu, x, y, z, dcpu->reg[REG_I]);
+      count = y;
+      break;
+    case 3: // checksum
+      checksum(dcpu, x, y);
+      count = y;
+      break;
+    default:
+      return 0;
+  }
+  unsigned cost = m->base + (m->rate ? (count + m->rate - 1) / m->rate : 0);
+  return cost > 0xffff ? 0xffff : cost;
+}
+
+static void memops_kill(dcpu *dcpu, device *dev) {
+  (void)dcpu;
+  free(dev->ctx);
+  dev->ctx = NULL;
+}
+
+// args are base=N and/or rate=N, separated by ':'
+bool dcpu_initmemops(dcpu *dcpu, const char *args) {
+  struct memops_t *m = calloc(1, sizeof(*m));
+  m->base = 4;
+  m->rate = 8;
+
+  char *opts = strdup(args), *opt = opts;
+  while (opt && *opt) {
+    char *next = strchr(opt, ':');
+    if (next) *next++ = '\0';
+    char *end = NULL;
+    if (!strncmp(opt, "base=", 5)) {
+      m->base = strtoul(opt + 5, &end, 0);
+    } else if (!strncmp(opt, "rate=", 5)) {
+      m->rate = strtoul(opt + 5, &end, 0);
+    }
+    if (!end || *end) {
+      dcpu_exitmsg("bad memops option '%s'\n", opt);
+      return false;
+    }
+    opt = next;
+  }
+  free(opts);
+
+  // set up hardware descriptors
+  device *dev = dcpu_addhw(dcpu);
+  dev->id = 0x6d656d6f; // "memo"
+  dev->version = 0x0001;
+  dev->mfr = 0; // not a real device
+  dev->hwi = &memops_hwi;
+  dev->kill = &memops_kill;
+  dev->ctx = m;
+  return true;
+}
@@ -0,0 +1,369 @@
+/*
+ * Copyright (c) 2012, Matt Hellige
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above copyright notice, 
+ *   this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above copyright 
+ *   notice, this list of conditions and the following disclaimer in the 
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR 
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT 
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, 
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY 
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dcpu.h"
+
+// a host pipe, for moving bulk data in and out of the guest without going
+// through the keyboard. the guest hands over a ring buffer in its own ram for
+// each direction, and every so often the host fills the input ring from a
+// file (or fifo) and drains the output ring into another, interrupting only
+// when a ring crosses its watermark.
+//
+// a ring at address r of size n looks like:
+//
+//   [r]      head: next slot the producer writes
+//   [r+1]    tail: next slot the consumer reads
+//   [r+2]... n slots of data
+//
+// head and tail are offsets into the data, and the ring is empty when they're
+// equal, so it holds at most n-1 words. the host is the producer for the
+// input ring and the consumer for the output ring, and only ever writes the
+// index it owns. each slot holds one byte, or two bytes big-endian in packed
+// mode (an odd byte at the end of the input is padded with zero).
+//
+// interrupts:
+//
+//   A=0: poll. sets B to the status bits below.
+//   A=1: set the interrupt message to X (0 disables interrupts).
+//   A=2: set up the input ring at X, with Y slots and watermark Z. packed if
+//        B is nonzero, and Y=0 disables it. head and tail are reset to 0.
+//   A=3: set up the output ring, likewise.
+//   A=4: move data now, rather than waiting for the next poll.
+//
+// the input ring interrupts when it fills to the watermark (or to one word,
+// if that's 0), and once at end of file. the output ring interrupts when
+// it drains to the watermark. either rearms once the guest has moved it
+// back past the watermark.
+
+#define PIPE_POLL_CYCLES 256
+
+enum {
+  STATUS_IN = 0x1,       // an input file is attached
+  STATUS_OUT = 0x2,      // an output file is attached
+  STATUS_EOF = 0x4,      // input is exhausted
+  STATUS_ERROR = 0x8,    // a read or write failed, or a ring is corrupt
+};
+
+struct ring_t {
+  u16 base;
+  u16 size; // 0 if disabled
+  u16 mark;
+  bool packed;
+  bool armed;
+};
+
+struct pipe_t {
+  int in, out; // -1 if not attached
+  u16 msg;
+  u16 status;
+  struct ring_t rx, tx;
+  int pending; // byte left over from a short packed write, or -1
+  int held; // odd byte from a packed read, waiting for its pair, or -1
+  unsigned countdown;
+};
+
+// big enough for a full ring in either mode
+static uint8_t iobuf[0x20000];
+
+static void notify(dcpu *dcpu, struct pipe_t *p) {
+  if (p->msg) dcpu_interrupt(dcpu, p->msg);
+}
+
+static void fail(dcpu *dcpu, struct pipe_t *p, const char *what) {
+  if (p->status & STATUS_ERROR) return;
+  dcpu_log(L_WARN, "pipe: %s: %s\n", what, strerror(errno));
+  p->status |= STATUS_ERROR;
+  notify(dcpu, p);
+}
+
+// read a ring's indices, checking the guest hasn't scribbled on them.
+static bool indices(dcpu *dcpu, struct pipe_t *p, struct ring_t *r,
+    u16 *head, u16 *tail) {
+  *head = dcpu->ram[r->base];
+  *tail = dcpu->ram[(u16)(r->base + 1)];
+  if (*head < r->size && *tail < r->size) return true;
+  errno = EINVAL;
+  fail(dcpu, p, "corrupt ring");
+  r->size = 0;
+  return false;
+}
+
+static void fill(dcpu *dcpu, struct pipe_t *p) {
+  struct ring_t *r = &p->rx;
+  u16 head, tail;
+  if (!r->size || !indices(dcpu, p, r, &head, &tail)) return;
+  u16 used = (head + r->size - tail) % r->size;
+  u16 space = r->size - 1 - used;
+
+  if (space && p->in >= 0 && !(p->status & STATUS_EOF)) {
+    size_t len = p->held >= 0;
+    if (p->held >= 0) iobuf[0] = p->held;
+    ssize_t n = read(p->in, iobuf + len, r->packed ? space * 2 - len : space);
+    if (n == 0) {
+      // only now is an odd byte really the last one, to be padded out
+      if (len) iobuf[len++] = 0;
+      p->status |= STATUS_EOF;
+    } else if (n < 0) {
+      if (errno != EAGAIN && errno != EINTR) fail(dcpu, p, "read");
+    } else {
+      len += n;
+    }
+
+    // in packed mode, an odd byte waits for the read that completes it
+    u16 words = r->packed ? len / 2 : len;
+    p->held = r->packed && (len & 1) ? iobuf[len - 1] : -1;
+    for (u16 i = 0; i < words; i++) {
+      u16 w = r->packed ? (iobuf[2 * i] << 8) | iobuf[2 * i + 1] : iobuf[i];
+      dcpu_write(dcpu, r->base + 2 + head, w);
+      if (++head == r->size) head = 0;
+    }
+    if (words) dcpu_write(dcpu, r->base, head);
+    used += words;
+    if (n == 0) notify(dcpu, p);
+  }
+
+  u16 mark = r->mark ? r->mark : 1;
+  if (used < mark) {
+    r->armed = true;
+  } else if (r->armed) {
+    r->armed = false;
+    notify(dcpu, p);
+  }
+}
+
+static void drain(dcpu *dcpu, struct pipe_t *p) {
+  struct ring_t *r = &p->tx;
+  u16 head, tail;
+  if (!r->size || !indices(dcpu, p, r, &head, &tail)) return;
+  u16 used = (head + r->size - tail) % r->size;
+
+  if (p->out >= 0 && !(p->status & STATUS_ERROR)) {
+    size_t len = 0, off = p->pending >= 0;
+    if (p->pending >= 0) iobuf[len++] = p->pending;
+    for (u16 i = 0, t = tail; i < used; i++) {
+      u16 w = dcpu->ram[(u16)(r->base + 2 + t)];
+      if (r->packed) iobuf[len++] = w >> 8;
+      iobuf[len++] = w;
+      if (++t == r->size) t = 0;
+    }
+
+    ssize_t n = len ? write(p->out, iobuf, len) : 0;
+    if (n < 0) {
+      if (errno != EAGAIN && errno != EINTR) fail(dcpu, p, "write");
+      n = 0;
+    }
+    if (n && p->pending >= 0) p->pending = -1;
+    n -= n ? off : 0;
+
+    // a packed word that was only half written is consumed anyway, and the
+    // other half kept back for next time.
+    u16 words = r->packed ? n / 2 : n;
+    if (r->packed && (n & 1)) {
+      p->pending = iobuf[off + n];
+      words++;
+    }
+    tail = (tail + words) % r->size;
+    dcpu_write(dcpu, r->base + 1, tail);
+    used -= words;
+  }
+
+  if (used > r->mark) {
+    r->armed = true;
+  } else if (r->armed) {
+    r->armed = false;
+    notify(dcpu, p);
+  }
+}
+
+static void pump(dcpu *dcpu, struct pipe_t *p) {
+  fill(dcpu, p);
+  drain(dcpu, p);
+  p->countdown = PIPE_POLL_CYCLES;
+}
+
+static void setup(dcpu *dcpu, struct ring_t *r) {
+  r->base = dcpu->reg[REG_X];
+  r->size = dcpu->reg[REG_Y];
+  r->mark = dcpu->reg[REG_Z];
+  r->packed = dcpu->reg[REG_B];
+  r->armed = true;
+  if (r->size) {
+    dcpu_write(dcpu, r->base, 0);
+    dcpu_write(dcpu, r->base + 1, 0);
+  }
+}
+
+static u16 pipe_hwi(dcpu *dcpu, device *dev) {
+  struct pipe_t *p = dev->ctx;
+  switch (dcpu->reg[REG_A]) {
+    case 0: // poll
+      dcpu->reg[REG_B] = p->status;
+      break;
+    case 1: // set interrupt
+      p->msg = dcpu->reg[REG_X];
+      break;
+    case 2: // set up input ring
+      setup(dcpu, &p->rx);
+      break;
+    case 3: // set up output ring
+      setup(dcpu, &p->tx);
+      break;
+    case 4: // move data now
+      pump(dcpu, p);
+      break;
+  }
+  return 0;
+}
+
+static void pipe_tick(dcpu *dcpu, device *dev, tstamp_t now) {
+  (void)now;
+  struct pipe_t *p = dev->ctx;
+  if (!--p->countdown) pump(dcpu, p);
+}
+
+static void save_ring(uint8_t **p, struct ring_t *r) {
+  u16 words[] = { r->base, r->size, r->mark, r->packed, r->armed };
+  for (size_t i = 0; i < sizeof(words) / 2; i++) {
+    *(*p)++ = words[i] >> 8;
+    *(*p)++ = words[i];
+  }
+}
+
+static void restore_ring(const uint8_t **p, struct ring_t *r) {
+  u16 words[5];
+  for (size_t i = 0; i < sizeof(words) / 2; i++, *p += 2)
+    words[i] = ((*p)[0] << 8) | (*p)[1];
+  r->base = words[0];
+  r->size = words[1];
+  r->mark = words[2];
+  r->packed = words[3];
+  r->armed = words[4];
+}
+
+// the files themselves aren't saved, so a restored guest carries on from
+// wherever they are now.
+#define PIPE_STATE_LEN (2 * 2 + 2 * 10)
+
+static size_t pipe_save(dcpu *dcpu, device *dev, void *buf, size_t len) {
+  (void)dcpu;
+  struct pipe_t *p = dev->ctx;
+  if (len >= PIPE_STATE_LEN) {
+    uint8_t *b = buf;
+    *b++ = p->msg >> 8;
+    *b++ = p->msg;
+    *b++ = 0;
+    *b++ = p->status & STATUS_EOF;
+    save_ring(&b, &p->rx);
+    save_ring(&b, &p->tx);
+  }
+  return PIPE_STATE_LEN;
+}
+
+static bool pipe_restore(dcpu *dcpu, device *dev, const void *buf,
+    size_t len) {
+  (void)dcpu;
+  struct pipe_t *p = dev->ctx;
+  if (len != PIPE_STATE_LEN) return false;
+  const uint8_t *b = buf;
+  p->msg = (b[0] << 8) | b[1];
+  p->status = (p->status & ~STATUS_EOF) | (b[3] & STATUS_EOF);
+  b += 4;
+  restore_ring(&b, &p->rx);
+  restore_ring(&b, &p->tx);
+  p->pending = p->held = -1;
+  return true;
+}
+
+static void pipe_kill(dcpu *dcpu, device *dev) {
+  struct pipe_t *p = dev->ctx;
+  if (p->out >= 0) {
+    // get whatever the guest left in the output ring out the door
+    fcntl(p->out, F_SETFL, fcntl(p->out, F_GETFL) & ~O_NONBLOCK);
+    drain(dcpu, p);
+    if (p->pending >= 0) {
+      uint8_t c = p->pending;
+      if (write(p->out, &c, 1) < 0) {} // nothing to be done now
+    }
+    close(p->out);
+  }
+  if (p->in >= 0) close(p->in);
+  free(p);
+  dev->ctx = NULL;
+}
+
+// args are in=path and/or out=path, separated by ':'. either may be a fifo,
+// in which case opening the output waits for a reader.
+bool dcpu_initpipe(dcpu *dcpu, const char *args) {
+  struct pipe_t *p = calloc(1, sizeof(*p));
+  p->in = p->out = -1;
+  p->pending = p->held = -1;
+  p->countdown = PIPE_POLL_CYCLES;
+
+  char *opts = strdup(args), *opt = opts;
+  while (opt && *opt) {
+    char *next = strchr(opt, ':');
+    if (next) *next++ = '\0';
+    if (!strncmp(opt, "in=", 3)) {
+      p->in = open(opt + 3, O_RDONLY | O_NONBLOCK);
+      if (p->in < 0) goto fail;
+      p->status |= STATUS_IN;
+    } else if (!strncmp(opt, "out=", 4)) {
+      p->out = open(opt + 4, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+      if (p->out < 0) goto fail;
+      fcntl(p->out, F_SETFL, fcntl(p->out, F_GETFL) | O_NONBLOCK);
+      p->status |= STATUS_OUT;
+    } else {
+      dcpu_exitmsg("unknown pipe option '%s'\n", opt);
+      return false;
+    }
+    opt = next;
+  }
+  free(opts);
+
+  // set up hardware descriptors
+  device *dev = dcpu_addhw(dcpu);
+  dev->id = 0x70697065; // "pipe"
+  dev->version = 0x0001;
+  dev->mfr = 0; // not a real device
+  dev->hwi = &pipe_hwi;
+  dev->tick = &pipe_tick;
+  dev->save = &pipe_save;
+  dev->restore = &pipe_restore;
+  dev->kill = &pipe_kill;
+  dev->ctx = p;
+  return true;
+
+fail:
+  dcpu_exitmsg("error opening pipe file '%s': %s\n", strchr(opt, '=') + 1,
+      strerror(errno));
+  return false;
+}
@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2012, Matt Hellige
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above copyright notice, 
+ *   this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above copyright 
+ *   notice, this list of conditions and the following disclaimer in the 
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR 
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT 
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, 
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY 
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <dlfcn.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dcpu.h"
+
+// hardware devices given on the command line as --device name[:args], either
+// built in or loaded from shared objects (--device lib.so[:args]). a plugin
+// is built against dcpu.h, and exports:
+//
+//   const int dcpu_device_abi = DCPU_DEVICE_ABI;
+//   bool dcpu_device_init(dcpu *dcpu, const char *args);
+//
+// init should add its device(s) with dcpu_addhw() and fill in the hooks,
+// keeping any per-instance state in ctx. it may be called more than once if
+// the same plugin is given several times. args is everything after the first
+// ':', or "" if there was none, and remains valid for the life of the
+// emulator. the emulator exports its own symbols (dcpu_interrupt, dcpu_log,
+// etc.) for plugins to call.
+
+typedef bool (*init_fn)(dcpu *, const char *);
+
+// devices built into the emulator, which are attached the same way, but by
+// name rather than by library. e.g., --device m35fd:disk.img
+static const struct {
+  const char *name;
+  init_fn init;
+} builtins[] = {
+  { "m35fd", &dcpu_initfloppy },
+  { "memops", &dcpu_initmemops },
+  { "pipe", &dcpu_initpipe },
+};
+
+bool dcpu_loaddevice(dcpu *dcpu, const char *spec) {
+  char *path = strdup(spec);
+  char *args = strchr(path, ':');
+  if (args) *args++ = '\0';
+  else args = "";
+
+  for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++)
+    if (!strcmp(path, builtins[i].name))
+      return builtins[i].init(dcpu, args);
+
+  // never closed. the device's hooks live in there.
+  void *lib = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+  if (!lib) {
+    dcpu_exitmsg("error loading device '%s': %s\n", path, dlerror());
+    free(path);
+    return false;
+  }
+
+  const int *abi = dlsym(lib, "dcpu_device_abi");
+  if (!abi || *abi != DCPU_DEVICE_ABI) {
+    dcpu_exitmsg("device '%s' was built for %s (need abi %d)\n", path,
+        abi ? "a different emulator abi" : "no known abi", DCPU_DEVICE_ABI);
+    free(path);
+    return false;
+  }
+
+  // the usual dance to keep -pedantic happy about object/function pointers
+  init_fn init;
+  *(void **)&init = dlsym(lib, "dcpu_device_init");
+  if (!init) {
+    dcpu_exitmsg("device '%s' has no dcpu_device_init\n", path);
+    free(path);
+    return false;
+  }
+
+  u16 before = dcpu->nhw;
+  if (!init(dcpu, args)) {
+    dcpu_exitmsg("device '%s' failed to initialize\n", path);
+    free(path);
+    return false;
+  }
+  // path isn't freed, since args points into it and devices may keep it.
+  dcpu_msg("loaded %d device(s) from %s\n", dcpu->nhw - before, path);
+  return true;
+}
@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2012, Matt Hellige
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above copyright notice, 
+ *   this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above copyright 
+ *   notice, this list of conditions and the following disclaimer in the 
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR 
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT 
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, 
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY 
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dcpu.h"
+
+// machine state snapshots: cpu, ram, and the state of any device that
+// implements the save/restore hooks. everything is big-endian, like core
+// files. devices are matched up by position, id and manufacturer, so a
+// snapshot can only be restored with the same hardware configuration.
+
+#define STATE_MAGIC   "DCPUSTAT"
+#define STATE_VERSION 1
+
+static bool put(FILE *f, uint64_t n, int bytes) {
+  for (int i = bytes - 1; i >= 0; i--)
+    if (fputc((n >> (i * 8)) & 0xff, f) == EOF) return false;
+  return true;
+}
+
+static bool get(FILE *f, uint64_t *n, int bytes) {
+  *n = 0;
+  for (int i = 0; i < bytes; i++) {
+    int c = fgetc(f);
+    if (c == EOF) return false;
+    *n = (*n << 8) | c;
+  }
+  return true;
+}
+
+static bool get16(FILE *f, u16 *w) {
+  uint64_t n;
+  if (!get(f, &n, 2)) return false;
+  *w = n;
+  return true;
+}
+
+bool dcpu_savestate(dcpu *dcpu, const char *path) {
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    dcpu_msg("error opening '%s': %s\n", path, strerror(errno));
+    return false;
+  }
+
+  bool ok = fwrite(STATE_MAGIC, 1, 8, f) == 8
+    && put(f, STATE_VERSION, 2)
+    && put(f, dcpu->cycles, 8)
+    && put(f, dcpu->pc, 2) && put(f, dcpu->sp, 2)
+    && put(f, dcpu->ex, 2) && put(f, dcpu->ia, 2);
+  for (int i = 0; ok && i < NREGS; i++) ok = put(f, dcpu->reg[i], 2);
+
+  u16 nints = (dcpu->intqwrite + INTQ_SIZE - dcpu->intqread) % INTQ_SIZE;
+  ok = ok && put(f, dcpu->qints, 2) && put(f, nints, 2);
+  for (u16 i = 0; ok && i < nints; i++)
+    ok = put(f, dcpu->intq[(dcpu->intqread + i) % INTQ_SIZE], 2);
+  for (uint32_t i = 0; ok && i < RAM_WORDS; i++) ok = put(f, dcpu->ram[i], 2);
+
+  ok = ok && put(f, dcpu->nhw, 2);
+  for (int i = 0; ok && i < dcpu->nhw; i++) {
+    device *dev = &dcpu->hw[i];
+    size_t len = dev->save ? dev->save(dcpu, dev, NULL, 0) : 0;
+    void *buf = len ? malloc(len) : NULL;
+    if (len) dev->save(dcpu, dev, buf, len);
+    ok = put(f, dev->id, 4) && put(f, dev->mfr, 4) && put(f, len, 4)
+      && fwrite(buf, 1, len, f) == len;
+    free(buf);
+  }
+
+  if (fclose(f) || !ok) {
+    dcpu_msg("error writing '%s': %s\n", path, strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+bool dcpu_loadstate(dcpu *dcpu, const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    dcpu_msg("error opening '%s': %s\n", path, strerror(errno));
+    return false;
+  }
+
+  char magic[8];
+  uint64_t n;
+  if (fread(magic, 1, 8, f) != 8 || memcmp(magic, STATE_MAGIC, 8)
+      || !get(f, &n, 2) || n != STATE_VERSION) {
+    dcpu_msg("'%s' is not a dcpu-16 state file\n", path);
+    fclose(f);
+    return false;
+  }
+
+  // read everything before touching the cpu, so that a bad file leaves the
+  // current state alone.
+  static struct dcpu_t saved;
+  static u16 ram[RAM_WORDS];
+  u16 qints = 0, nints = 0;
+  bool ok = get(f, &saved.cycles, 8)
+    && get16(f, &saved.pc) && get16(f, &saved.sp)
+    && get16(f, &saved.ex) && get16(f, &saved.ia);
+  for (int i = 0; ok && i < NREGS; i++) ok = get16(f, &saved.reg[i]);
+  ok = ok && get16(f, &qints) && get16(f, &nints) && nints < INTQ_SIZE;
+  for (u16 i = 0; ok && i < nints; i++) ok = get16(f, &saved.intq[i]);
+  for (uint32_t i = 0; ok && i < RAM_WORDS; i++) ok = get16(f, &ram[i]);
+  ok = ok && get(f, &n, 2);
+  if (ok && n != dcpu->nhw) {
+    dcpu_msg("'%s' has %d devices, but there are %d attached\n", path,
+        (int)n, dcpu->nhw);
+    fclose(f);
+    return false;
+  }
+
+  size_t *lens = calloc(dcpu->nhw, sizeof(size_t));
+  void **bufs = calloc(dcpu->nhw, sizeof(void *));
+  for (int i = 0; ok && i < dcpu->nhw; i++) {
+    uint64_t id, mfr, len;
+    ok = get(f, &id, 4) && get(f, &mfr, 4) && get(f, &len, 4);
+    if (ok && (id != dcpu->hw[i].id || mfr != dcpu->hw[i].mfr)) {
+      dcpu_msg("device %d in '%s' doesn't match: %08x (%08x)\n", i, path,
+          (unsigned)id, (unsigned)mfr);
+      ok = false;
+    }
+    if (ok && len) {
+      bufs[i] = malloc(len);
+      lens[i] = len;
+      ok = fread(bufs[i], 1, len, f) == len;
+    }
+  }
+  if (!ok) dcpu_msg("error reading '%s'\n", path);
+  fclose(f);
+
+  if (ok) {
+    dcpu->cycles = saved.cycles;
+    dcpu->pc = saved.pc;
+    dcpu->sp = saved.sp;
+    dcpu->ex = saved.ex;
+    dcpu->ia = saved.ia;
+    memcpy(dcpu->reg, saved.reg, sizeof(dcpu->reg));
+    dcpu->qints = qints;
+    memcpy(dcpu->intq, saved.intq, sizeof(dcpu->intq));
+    dcpu->intqread = 0;
+    dcpu->intqwrite = nints;
+    memcpy(dcpu->ram, ram, sizeof(ram));
+    memset(dcpu->dirty, 0xff, sizeof(dcpu->dirty));
+
+    for (int i = 0; i < dcpu->nhw; i++) {
+      device *dev = &dcpu->hw[i];
+      if (!lens[i]) continue;
+      if (!dev->restore || !dev->restore(dcpu, dev, bufs[i], lens[i]))
+        dcpu_msg("warning: couldn't restore state of device %d\n", i);
+    }
+  }
+
+  for (int i = 0; i < dcpu->nhw; i++) free(bufs[i]);
+  free(bufs);
+  free(lens);
+  return ok;
+}
@@ -27,61 +27,121 @@
 
 #include <errno.h>
 #include <ncurses.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "dcpu.h"
+#include "lem.h"
 
 // this number is relatively arbitrary, but it really doesn't matter
 // what it is. the terminal driver will continue to buffer keys anyway,
-// we just won't trigger interrupts for them until the keybuf is
-// drained a bit.
+// we just won't read them until the keybuf is drained a bit. it must be a
+// power of two.
 #define KEYBUF_SIZE 256
 
 struct term_t {
   WINDOW *border;
   WINDOW *vidwin;
   WINDOW *dbgwin;
-  tstamp_t tickns;
-  tstamp_t nexttick;
-  tstamp_t keyns;
-  tstamp_t nextkey;
-  u16 vram;
+  lem_display lem;
+  // only touched by lem_render, holding curses_lock:
+  u16 contents[SCR_HEIGHT * SCR_WIDTH]; // what's currently on screen
+  u16 shownvram;
+  bool full; // force a full redraw on the next frame
   u16 curborder;
-  u16 nextborder;
-  int keybuf[KEYBUF_SIZE];
-  int keybufwrite;
-  int keybufread;
   u16 kbdints;
+
+  // keys are read by their own thread, and handed to the emulator through a
+  // single-producer, single-consumer ring. keybufwrite is only written by the
+  // keyboard thread, keybufread only by the emulator. both count up forever.
+  int keybuf[KEYBUF_SIZE];
+  unsigned keybufwrite;
+  unsigned keybufread;
+  unsigned keyseen; // keys we've already raised interrupts for
+  pthread_t kbdthread;
+  bool kbdrunning;
+  bool kbdpaused; // in the debugger. protected by curses_lock
+  bool kbdquit;
+  int wakefd[2]; // to interrupt the keyboard thread's poll
 };
 
 static struct term_t term;
 
+// curses isn't thread-safe, and the display is drawn on its own thread. every
+// curses call must be made holding this lock.
+static pthread_mutex_t curses_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t kbd_resume = PTHREAD_COND_INITIALIZER;
+
 static inline u16 color(int fg, int bg) {
   return COLORS > 8
     ? fg * 16 + bg + 1
     : (fg % 8) * 8 + (bg % 8) + 1;
 }
 
-static void checkkey(dcpu *dcpu) {
-  int nextwrite = (term.keybufwrite+1) % KEYBUF_SIZE;
-  if (nextwrite != term.keybufread) {
-    // buf has an empty slot, try to use it...
+// drain whatever curses has for us into the keybuf. returns false at eof.
+static bool drainkeys(void) {
+  pthread_mutex_lock(&curses_lock);
+  // the debugger reads the terminal itself, so stay out of its way.
+  while (term.kbdpaused && !__atomic_load_n(&term.kbdquit, __ATOMIC_ACQUIRE))
+    pthread_cond_wait(&kbd_resume, &curses_lock);
+
+  bool any = false;
+  unsigned write = term.keybufwrite;
+  while (write - __atomic_load_n(&term.keybufread, __ATOMIC_ACQUIRE)
+      < KEYBUF_SIZE) {
     int c = getch();
-    if (c == ERR) return; // no key, no problem.
+    if (c == ERR) break;
+    term.keybuf[write % KEYBUF_SIZE] = c;
+    write++;
+    any = true;
+  }
+  __atomic_store_n(&term.keybufwrite, write, __ATOMIC_RELEASE);
+  bool full = write - __atomic_load_n(&term.keybufread, __ATOMIC_ACQUIRE)
+      >= KEYBUF_SIZE;
+  pthread_mutex_unlock(&curses_lock);
 
-    // enqueue key, raise interrupt if possible
-    term.keybuf[term.keybufwrite] = c;
-    if (term.kbdints) dcpu_interrupt(dcpu, term.kbdints);
-    term.keybufwrite = nextwrite;
+  if (full) {
+    // wait for the guest to catch up a bit...
+    struct timespec ts = { 0, 1000000 };
+    nanosleep(&ts, NULL);
+  }
+  return any || full;
+}
+
+static void *kbd_loop(void *arg) {
+  (void)arg;
+  struct pollfd fds[2] = {
+    { 0, POLLIN, 0 },
+    { term.wakefd[0], POLLIN, 0 },
+  };
+  while (!__atomic_load_n(&term.kbdquit, __ATOMIC_ACQUIRE)) {
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    if (fds[1].revents) continue; // check whether we're done
+    if (fds[0].revents & (POLLIN | POLLHUP)) {
+      // input on a closed pipe shows up as a hangup with (possibly) data
+      // still to read. we're only done once it's drained.
+      if (!drainkeys() && (fds[0].revents & (POLLHUP | POLLERR))) break;
+    } else if (fds[0].revents) {
+      break;
+    }
   }
+  return NULL;
 }
 
 static void readkey(dcpu *dcpu) {
   int c = 0;
-  if (term.keybufread != term.keybufwrite) {
-    c = term.keybuf[term.keybufread++];
-    term.keybufread %= KEYBUF_SIZE;
+  unsigned read = term.keybufread;
+  if (read != __atomic_load_n(&term.keybufwrite, __ATOMIC_ACQUIRE)) {
+    c = term.keybuf[read % KEYBUF_SIZE];
+    __atomic_store_n(&term.keybufread, read + 1, __ATOMIC_RELEASE);
   }
   switch (c) {
     // these key codes are non-ascii, obviously, per the keyboard spec.
@@ -103,13 +163,16 @@ static void readkey(dcpu *dcpu) {
   dcpu->reg[REG_C] = c; // always set c
 }
 
-static u16 kbd_hwi(dcpu *dcpu) {
+static u16 kbd_hwi(dcpu *dcpu, device *dev) {
+  (void)dev;
   switch (dcpu->reg[REG_A]) {
-    case 0:
+    case 0: {
       // clear kbd buf. of course the terminal could still have stuff buffered.
-      term.keybufwrite = 0;
-      term.keybufread = 0;
+      unsigned write = __atomic_load_n(&term.keybufwrite, __ATOMIC_ACQUIRE);
+      __atomic_store_n(&term.keybufread, write, __ATOMIC_RELEASE);
+      term.keyseen = write;
       break;
+    }
     case 1:
       readkey(dcpu);
       break;
@@ -122,44 +185,69 @@ static u16 kbd_hwi(dcpu *dcpu) {
       term.kbdints = dcpu->reg[REG_B];
       break;
     default:
-      dcpu_msg("warning: unknown keyboard HWI: 0x%04x\n", dcpu->reg[REG_A]);
+      dcpu_log(L_WARN, "warning: unknown keyboard HWI: 0x%04x\n", dcpu->reg[REG_A]);
   }
   return 0; // no extra cycles
 }
 
-static void kbd_tick(dcpu *dcpu, tstamp_t now) {
-  if (now > term.nextkey) {
-    checkkey(dcpu);
-    term.nextkey += term.keyns;
+// only the interrupt message is saved. keys still in the ring are the
+// terminal's, not the guest's.
+static size_t kbd_save(dcpu *dcpu, device *dev, void *buf, size_t len) {
+  (void)dcpu; (void)dev;
+  uint8_t *p = buf;
+  if (len >= 2) {
+    p[0] = term.kbdints >> 8;
+    p[1] = term.kbdints;
   }
+  return 2;
+}
+
+static bool kbd_restore(dcpu *dcpu, device *dev, const void *buf,
+    size_t len) {
+  (void)dcpu; (void)dev;
+  const uint8_t *p = buf;
+  if (len != 2) return false;
+  term.kbdints = (p[0] << 8) | p[1];
+  return true;
+}
+
+// no syscalls here, just a look at the ring to see if anything new arrived.
+static void kbd_tick(dcpu *dcpu, device *dev, tstamp_t now) {
+  (void)dev;
+  (void)now;
+  unsigned write = __atomic_load_n(&term.keybufwrite, __ATOMIC_ACQUIRE);
+  for (; term.keyseen != write; term.keyseen++)
+    if (term.kbdints) dcpu_interrupt(dcpu, term.kbdints);
 }
 
-static u16 lem_hwi(dcpu *dcpu) {
+static u16 lem_hwi(dcpu *dcpu, device *dev) {
+  (void)dev;
   switch (dcpu->reg[REG_A]) {
     case 0: // MEM_MAP_SCREEN
-      term.vram = dcpu->reg[REG_B];
+      term.lem.regs.vram = dcpu->reg[REG_B];
       break;
     case 1: // MEM_MAP_FONT
-      dcpu_msg("warning: MEM_MAP_FONT unsupported on text-only terminal.\n");
+      dcpu_log(L_WARN, "warning: MEM_MAP_FONT unsupported on text-only terminal.\n");
       break;
     case 2: // MEM_MAP_PALETTE
       // TODO should be able to approx. this on on changeable terminals
-      dcpu_msg("warning: MEM_MAP_PALETTE unsupported on text-only terminal.\n");
+      dcpu_log(L_WARN, "warning: MEM_MAP_PALETTE unsupported on text-only terminal.\n");
       break;
     case 3: // SET_BORDER_COLOR
-      term.nextborder = dcpu->reg[REG_B] & 0xf;
+      term.lem.regs.border = dcpu->reg[REG_B] & 0xf;
       break;
     case 4: // MEM_DUMP_FONT
-      dcpu_msg("warning: MEM_DUMP_FONT unsupported on text-only terminal.\n");
+      dcpu_log(L_WARN, "warning: MEM_DUMP_FONT unsupported on text-only terminal.\n");
       break;
     case 5: // MEM_DUMP_PALETTE
-      dcpu_msg("warning: MEM_DUMP_PALETTE unsupported on text-only terminal.\n");
+      dcpu_log(L_WARN, "warning: MEM_DUMP_PALETTE unsupported on text-only terminal.\n");
       break;
   }
   return 0; // no extra cycles
 }
 
 void dcpu_exitmsg(char *fmt, ...) {
+  dcpu_flushlog();
   dcpu_killterm();
   va_list args;
   va_start(args, fmt);
@@ -167,28 +255,68 @@ void dcpu_exitmsg(char *fmt, ...) {
   va_end(args);
 }
 
+// has a key been typed? call holding curses_lock. the key stays unread.
+static bool typed(void) {
+  noecho();
+  wtimeout(term.dbgwin, 0);
+  int c = wgetch(term.dbgwin);
+  wtimeout(term.dbgwin, -1);
+  echo();
+  if (c == ERR) return false;
+  ungetch(c);
+  return true;
+}
+
 int dcpu_getstr(char *buf, int n) {
-  return wgetnstr(term.dbgwin, buf, n) == OK;
+  dcpu_flushlog();
+  pthread_mutex_lock(&curses_lock);
+  // the display and the log sink both need the lock, so don't sit on it
+  // until there's a line to read.
+  while (!typed()) {
+    pthread_mutex_unlock(&curses_lock);
+    struct pollfd fd = { 0, POLLIN, 0 };
+    int res = poll(&fd, 1, -1);
+    pthread_mutex_lock(&curses_lock);
+    // at eof or on error, leave it to wgetnstr to fail
+    if ((res < 0 && errno != EINTR) || (fd.revents & ~POLLIN)) break;
+  }
+  int res = wgetnstr(term.dbgwin, buf, n);
+  pthread_mutex_unlock(&curses_lock);
+  return res == OK;
 }
 
-void dcpu_msg(char *fmt, ...) {
-  va_list args;
-  va_start(args, fmt);
-  vwprintw(term.dbgwin, fmt, args);
+// the curses sink for log.c. one refresh per batch of messages.
+void dcpu_termwrite(const char **lines, int n) {
+  if (!term.dbgwin) {
+    // curses is gone (or not here yet)
+    for (int i = 0; i < n; i++) fputs(lines[i], stderr);
+    return;
+  }
+  pthread_mutex_lock(&curses_lock);
+  for (int i = 0; i < n; i++) waddstr(term.dbgwin, lines[i]);
   wrefresh(term.dbgwin);
-  va_end(args);
+  pthread_mutex_unlock(&curses_lock);
 }
 
 void dcpu_runterm(void) {
+  pthread_mutex_lock(&curses_lock);
   curs_set(0);
   timeout(0);
   noecho();
+  term.kbdpaused = false;
+  pthread_cond_signal(&kbd_resume);
+  pthread_mutex_unlock(&curses_lock);
+  dcpu_logsync(false);
 }
 
 void dcpu_dbgterm(void) {
+  dcpu_logsync(true);
+  pthread_mutex_lock(&curses_lock);
   curs_set(1);
   timeout(-1);
   echo();
+  term.kbdpaused = true;
+  pthread_mutex_unlock(&curses_lock);
 }
 
 static void draw(u16 word, u16 row, u16 col) {
@@ -210,46 +338,91 @@ static void draw(u16 word, u16 row, u16 col) {
   if (blink) wattroff(term.vidwin, A_BLINK);
 }
 
-static void draw_border() {
-  if (term.curborder != term.nextborder) {
-    term.curborder = term.nextborder;
+static void draw_border(u16 border) {
+  if (term.curborder != border) {
+    term.curborder = border;
     wbkgd(term.border, A_NORMAL | COLOR_PAIR(color(0, term.curborder)) | ' '); 
     wrefresh(term.border);
   }
 }
 
-static void lem_redraw(dcpu *dcpu) {
-  draw_border();
-  if (term.vram) {
-    // don't perform the indirection outside the loop. vid ram can be mapped
-    // toward the high end of the range, in which case we need to be careful
-    // that it wraps around to the start.
-    u16 addr = term.vram;
-    for (u16 i = 0; i < SCR_HEIGHT; i++) 
-      for (u16 j = 0; j < SCR_WIDTH; j++)
-        draw(dcpu->ram[addr++], i, j);
+// runs on the render thread
+static void lem_render(const lem_frame *frame, bool fresh, tstamp_t now) {
+  (void)now;
+  if (!fresh) return; // blinking is left to the terminal
+
+  pthread_mutex_lock(&curses_lock);
+  draw_border(frame->regs.border);
+  bool full = term.full || frame->regs.vram != term.shownvram;
+  term.shownvram = frame->regs.vram;
+  term.full = false;
+
+  bool changed = false;
+  if (frame->regs.vram) {
+    // only touch the cells that actually changed.
+    for (u16 i = 0; i < SCR_HEIGHT; i++) {
+      for (u16 j = 0; j < SCR_WIDTH; j++) {
+        int idx = i * SCR_WIDTH + j;
+        u16 word = frame->vram[idx];
+        if (full || word != term.contents[idx]) {
+          term.contents[idx] = word;
+          draw(word, i, j);
+          changed = true;
+        }
+      }
+    }
+  } else {
+    // nothing mapped. nothing to do, unless we've just been unmapped.
+    changed = full;
   }
-  wrefresh(term.vidwin);
+
+  if (changed) wrefresh(term.vidwin);
+  pthread_mutex_unlock(&curses_lock);
 }
 
-static void lem_tick(dcpu *dcpu, tstamp_t now) {
-  if (now > term.nexttick) {
-    lem_redraw(dcpu);
-    term.nexttick += term.tickns;
-  }
+static const lem_backend curses_backend = { NULL, &lem_render, NULL };
+
+static void lem_tick(dcpu *dcpu, device *dev, tstamp_t now) {
+  (void)dev;
+  lem_update(&term.lem, dcpu, now);
+}
+
+// the curses display ignores the font and palette, but saves them anyway,
+// so that a snapshot means the same with any display.
+static size_t lem_save(dcpu *dcpu, device *dev, void *buf, size_t len) {
+  (void)dcpu; (void)dev;
+  return lem_saveregs(&term.lem.regs, buf, len);
+}
+
+static bool lem_restore(dcpu *dcpu, device *dev, const void *buf,
+    size_t len) {
+  (void)dev;
+  if (!lem_restoreregs(&term.lem.regs, buf, len)) return false;
+  lem_publish(&term.lem, dcpu, true);
+  return true;
+}
+
+static void lem_ondebug(dcpu *dcpu, device *dev) {
+  (void)dev;
+  lem_publish(&term.lem, dcpu, true);
+  // and draw it right away, so it's up before the debugger's prompt
+  static lem_frame frame;
+  lem_snapshot(dcpu, &term.lem.regs, &frame);
+  lem_render(&frame, true, dcpu_now());
 }
 
 void dcpu_initterm(dcpu *dcpu, bool display) {
-  term.tickns = 1000000000 / DISPLAY_HZ;
-  term.nexttick = dcpu_now();
-  term.keyns = 1000000000 / KBD_BAUD;
-  term.nextkey = dcpu_now();
   term.curborder = 0;
-  term.nextborder = 0;
-  term.vram = 0;
+  term.shownvram = 0;
+  term.full = true;
+  lem_init(&term.lem);
   term.keybufwrite = 0;
   term.keybufread = 0;
+  term.keyseen = 0;
   term.kbdints = 0;
+  term.kbdrunning = false;
+  term.kbdpaused = true;
+  term.kbdquit = false;
 
   // set up hardware descriptors
   device *kbd = dcpu_addhw(dcpu);
@@ -259,6 +432,8 @@ void dcpu_initterm(dcpu *dcpu, bool display) {
   kbd->hwi = &kbd_hwi;
   kbd->tick = &kbd_tick;
   kbd->on_debug = NULL;
+  kbd->save = &kbd_save;
+  kbd->restore = &kbd_restore;
   if (display) { // TODO this is pretty hokey
     device *lem = dcpu_addhw(dcpu);
     lem->id = 0x7349f615;
@@ -266,7 +441,9 @@ void dcpu_initterm(dcpu *dcpu, bool display) {
     lem->mfr = 0x1c6c8b36;
     lem->hwi = &lem_hwi;
     lem->tick = &lem_tick;
-    lem->on_debug = &lem_redraw;
+    lem->on_debug = &lem_ondebug;
+    lem->save = &lem_save;
+    lem->restore = &lem_restore;
   }
 
   // set up curses...
@@ -296,11 +473,38 @@ void dcpu_initterm(dcpu *dcpu, bool display) {
       for (int j = 0; j < 8; j++)
         init_pair(color(i, j), colors[i], colors[j]);
   }
+
+  if (display && !lem_start(&term.lem, &curses_backend)) {
+    dcpu_exitmsg("unable to start display thread\n");
+    exit(1);
+  }
+  if (pipe(term.wakefd)
+      || pthread_create(&term.kbdthread, NULL, &kbd_loop, NULL)) {
+    dcpu_exitmsg("unable to start keyboard thread: %s\n", strerror(errno));
+    exit(1);
+  }
+  term.kbdrunning = true;
+
   dcpu_msg("terminal colors: %d, pairs %d, %s change colors: \n", COLORS,
       COLOR_PAIRS, can_change_color() ? "*can*" : "*cannot*");
 }
 
 u16 dcpu_killterm(void) {
+  if (term.kbdrunning) {
+    pthread_mutex_lock(&curses_lock);
+    __atomic_store_n(&term.kbdquit, true, __ATOMIC_RELEASE);
+    pthread_cond_signal(&kbd_resume);
+    pthread_mutex_unlock(&curses_lock);
+    if (write(term.wakefd[1], "", 1) < 0) { /* it'll notice eventually */ }
+    pthread_join(term.kbdthread, NULL);
+    close(term.wakefd[0]);
+    close(term.wakefd[1]);
+    term.kbdrunning = false;
+  }
+  lem_stop(&term.lem);
+  pthread_mutex_lock(&curses_lock);
   endwin();
-  return term.vram;
+  term.dbgwin = NULL;
+  pthread_mutex_unlock(&curses_lock);
+  return term.lem.regs.vram;
 }
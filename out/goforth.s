@@ -0,0 +1,3335 @@
+;
+; Copyright (c) 2012, Matt Hellige
+; All rights reserved.
+;
+; Redistribution and use in source and binary forms, with or without 
+; modification, are permitted provided that the following conditions are met:
+;
+;   Redistributions of source code must retain the above copyright notice, 
+;   this list of conditions and the following disclaimer.
+;
+;   Redistributions in binary form must reproduce the above copyright 
+;   notice, this list of conditions and the following disclaimer in the 
+;   documentation and/or other materials provided with the distribution.
+;
+; THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+; "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+; LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR 
+; A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT 
+; HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+; SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 
+; LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, 
+; DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY 
+; THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+; (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+; OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+; this is an implementation of forth for the dcpu-16 augmented with a few
+; io instructions.
+;
+; the core dictionary layout and assembler routines are influenced by
+; jonesforth:
+;   http://rwmj.wordpress.com/2010/08/07/jonesforth-git-repository/
+; although jonesforth has a number of quirks (and so does this one) and
+; things diverge pretty quickly.
+;
+; in any case, this is a 'classic' indirect-threaded forth, in which
+; code fields contain pointers to executable machine code. i've given
+; some thought to direct threading, but given the rather bizarre cost
+; model of the dcpu-16, it doesn't seem to me that it would actually
+; be significantly faster, and it would definitely be more complex
+; (since, for example, code words might have to be larger than 1 cell).
+; the specific dcpu-16 characteristics that matter here are:
+;    - memory access is literally free (a single cycle)...
+;    - ... EXCEPT when you're decoding the instruction stream, in which
+;      case there's a penalty of 1 cycle per word
+;    - addition is free (0 extra cycles) when it's used to compute an address
+;      offset for an operand, otherwise it's 2 extra cycles
+; direct threading might be more of a win if the forth ip points to the
+; currently executing word rather than to the *next* word, but that would
+; be a more significant change, and i'd have to think harder about the
+; ramifications. maybe some other time...
+;
+; ...or, as it turns out, if the forth ip lives in i. then next is just
+; 'sti pc, [i]', 1 word and 2 cycles rather than 3 words and 4 cycles. so
+; there's also a direct-threaded build, chosen when the image is built
+; (see threading_dtc below and FORTH_THREADING in the Makefile). there,
+; a primitive's code field is its machine code, and everything else gets
+; a 2 cell 'jsr docol' (or dovar, etc.), which leaves the data field
+; address on the return stack. the .ft files stay out of it by using
+; >body, >code-address and friends.
+;
+; so which is faster? bootstrapping goforth.img spends most of its time in
+; native code (accept, emit, parsing and find), so there's not much in it:
+;                   indirect      direct    (cycles, from the first key)
+;    goforth.ft    2,752,000   2,709,000
+;    asm.ft        2,064,000   2,004,000
+;    disasm.ft     2,199,000   2,141,000
+; but forth code that mostly runs simple words gains more. for example,
+; '0 10000 0 do i + dup drop 1+ loop drop' takes 977,000 cycles indirect
+; and 756,000 direct. the direct kernel is also 243 words smaller, though
+; each colon word, variable and constant is a cell bigger.
+;
+; register mappings:
+;  SP  return stack pointer (rsp sometimes below)
+;  Z   data stack pointer
+;  Y   forth instruction pointer (ip), direct-threaded: I
+;  X   forth codeword pointer, direct-threaded: scratch
+;
+; notice we use the 'hardware' stack for the return stack and explicitly
+; manage the data stack. by default, we also do not keep the top of the
+; data stack in a register. there is a build that does (see cache_tos
+; below and FORTH_TOS in the Makefile), but on the dcpu-16 it does not
+; pay. [z] is free as an operand, so the register only saves the extra
+; cycle for [1+z] and friends, while every push has to spill it and every
+; pop has to reload it:
+;                   indirect  +register      direct  +register
+;    goforth.ft    2,752,000  2,763,000   2,709,000  2,720,000
+;    asm.ft        2,064,000  2,078,000   2,004,000  2,017,000
+;    disasm.ft     2,200,000  2,210,000   2,141,000  2,151,000
+;    the loop        977,000    987,000     756,000    766,000
+; the kernel is 4 words smaller, for what it is worth.
+;
+; dictionary entries:
+;     +----------------------+
+;     | 16 hash chain        |
+;     | 16 link to prev word |<--- entry address (latest, links, etc.)
+;     | 16 flags/name length |
+;     | 16 ... name
+;     | 16 codeword          |
+;     | 16 ... definition    |
+;     +----------------------+
+; in the case of primitives, codeword simply points to definition, which is
+; machine code. (it could be anywhere, but will generally follow immediately
+; after codeword.) in the case of forth words, we have:
+;     +----------------------+
+;     | 16 hash chain        |
+;     | 16 link to prev word |
+;     | 16 flags/name length |          DOCOL
+;     | 16 ... name          |         +---------------------+
+;     | 16 ptr to DOCOL     ---------->| 16 ... machine code |
+;     | 16 ... ptr to words  |         | 16 ... NEXT         |
+;     | 16 ptr to EXIT       |         +---------------------+
+;     +----------------------+
+; 'ptr to ...' means a pointer directly to the codeword field of the definition.
+; the hash chain links each entry to the next older one whose name falls in
+; the same bucket of the dictionary index (see find_), so that lookups don't
+; have to walk the whole dictionary. the plain link chain is still there for
+; everything else.
+
+; the overall memory layout. this isn't yet fully implemented, but an
+; important point is that we want to be sure that everything important
+; is below h, so that we can simply dump a bootable image by including
+; only everything from 0 to h. we have to be just a bit careful about
+; variables, but it's pretty easy to get it right.
+;     +----------------------+
+;     | block buffers (2kb)  |<--- r0
+;     | return stack         |
+;     |        |             |
+;     |        v             |
+;     | text input buffer    |<--- tib,s0 0xf000
+;     | data stack/unused    |
+;     |        |             |
+;     |        |             |
+;     |        |             |
+;     |        v             |
+;     | reserved (video)     | 0x8000 - 0x8400
+;     |        ^             |
+;     |        |             |
+;     | pad (n words from h) |<--- pad
+;     |        ^             |
+;     |        |             |<--- h
+;     | user dictionary      |
+;     | system variables     |
+;     | core image           |
+;     +----------------------+
+
+; finally, m4 is a pretty broke-ass way to get macros, but i want to invest as
+; little as possible in the dcpu assembler. i'd rather bootstrap everything from
+; within forth as soon as possible...
+
+; TODO all the io primitives and the dictionary use whole words for ascii chars.
+; this is much easier in the absence of byte addressing, but it's also terribly
+; wasteful. fix, or at least introduce 'packed strings' for dictionary names.
+
+
+
+
+
+; the screen is a window onto a bigger buffer of text, so that scrolling
+; is mostly a matter of moving the window (see scroll_)
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+; the data stack. normally all of it is in memory, with the top at [z].
+; with cache_tos (see FORTH_TOS in the Makefile), the top item lives in a
+; register instead, i when indirect-threaded or y when direct, and [z] is
+; the second. primitives reach the stack through these, so most of them
+; read the same either way.
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+; number of buckets in the dictionary index. must be a power of 2
+
+
+; size of the keyboard queue (see readkey). must be a power of 2
+
+
+; defheader(forthnam, flags, asmname)
+; all the words use this macro for their header. they're all the same
+; up to the code field
+
+
+; defword(forthname, flags, asmname)
+
+            ; word ptrs follow...
+
+; defcode(forthname, flags, asmname)
+  ; code follows...
+
+; defvar(forthname, asmname, value)
+
+
+; defconst(forthname, asmname, value)
+
+
+; boot...
+            jsr inithw              ; locate/initialize hardware
+            set [kbuf_r], 0         ; no keys queued yet
+            set [kbuf_w], 0
+            ias int_                ; take keyboard (and clock) interrupts
+            set a, 3                ; a == 3: interrupt with message b
+            set b, 1
+            hwi [kbd]
+            set a, 0                ; a == 0: MEM_MAP_SCREEN
+            set b, 0x8000          ; b contains mem map addr
+            hwi [display]
+            ; return stack grows down from 0xffff
+            ; but sp already starts at 0, so we might as well assume it
+            set z, 0xf000              ; data stack grows down from here
+            set [curvid], 0         ; reset video ram position
+            set [curline], 0        ; reset current line start position
+            set [vidend], 0x0180 ; the window is at the start
+            set a, task0            ; the boot task is the only one
+            set [a], a
+            set [2+a], 1
+            set [var_thistask], a
+            ife [hashed], 0         ; index the built-in words, first time only
+            jsr rehash_
+            set y, var_bootword    ; boot up
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+inithw:     set [kbd], 0xffff       ; init to unlikely value...
+            set [display], 0xffff
+            set [clock], 0xffff     ; (this one is optional)
+            hwn z
+inithw.1:   sub z, 1
+            ifu z, 0                ; finished iterating?
+            set pc, inithw.2
+            hwq z
+            ife a, 0x7406
+            ife b, 0x30cf
+            set [kbd], z
+            ife a, 0xf615
+            ife b, 0x7349
+            set [display], z
+            ife a, 0xb402
+            ife b, 0x12d0
+            set [clock], z
+            set pc, inithw.1
+inithw.2:   ifn [kbd], 0xffff       ; if everything found, return
+            ifn [display], 0xffff
+            set pc, pop
+            dbg 0                   ; otherwise, debug
+            set pc, pop             ; then return
+
+            ; we need a few variables for positions in the various memory
+            ; mapped buffers, hardware locations, etc., but we need to be very
+            ; sure that they get reset on every boot. we could just stick them
+            ; somewhere higher in the address range (i.e., outside of the
+            ; saved image), but just explicitly setting them is probably safer
+            ; and clearer.
+curvid:     dw 0                    ; position in video ram
+curline:    dw 0                    ; start of current line (for backspace)
+vidend:     dw 0                    ; end of the window onto video ram
+kbd:        dw 0                    ; hardware id of keyboard
+display:    dw 0                    ; hardware id of display
+clock:      dw 0                    ; hardware id of clock
+kbuf_r:     dw 0                    ; keys taken from kbuf, ever
+kbuf_w:     dw 0                    ; keys put in kbuf, ever
+kbuf:       dw 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+
+
+; the interpreters for non-primitive words. when direct-threaded, they are
+; reached with a jsr from the code field, so the address of the data field
+; is on the return stack instead of just after x.
+
+; interpreter for variables (and newly created words, per ans)
+dovar:      sub z, 1                ; push data field address
+            set [z], x              ; which is one cell after the code field
+            add [z], 1
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+; interpreter for constants
+docon:      sub z, 1                ; push data field contents
+            add x, 1                ; data field is one cell after the code field
+            set [z], [x]
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+; interpreter for forth words
+docol:      set push, y
+            set y, x                ; set y to word definition...
+            add y, 1                ; which is one cell after the code field
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+
+; interpreter for does> words. this is some funky business... the obvious way
+; to implement does> is just to compile the address of dodoes in the code field
+; (i.e., in place of docol) and have it look up the address of the does-handler
+; in the cell following x. but since it's nice if does> works on any kind of
+; word, then the obvious solution is to change docol to 'add y, 2' and waste a
+; cell of storage in every word. on a resource-constrained machine, this is a
+; major bummer. so, instead, for each instance of does>, we create a dispatch
+; jsr instruction at the start of the does-handler, just prior to the start of
+; the compiled forth words. does> then places the address of this jsr in the
+; code field of the child word, and dodoes gets its does-handler address on the
+; regular 'hardware' stack. and at this point, it's probably easier just to see
+; it...
+;     +----------------------+
+;     | 16 hash chain        |
+;     | 16 0 to prev word |
+;     | 16 flags/name length |          DODOES
+;     | 16 ... name          |         +------------------------+
+;  +--- 16 ptr to dispatch   |  +----->| 16 ... machine code    |
+;  |  | 16 ... ptr to words  |  |      |   (does> code in peek) |
+;  |  | 16 ptr to EXIT       |  |      | 16 ... NEXT            |
+;  +->| 16/32  jsr DODOES   ----+      +------------------------+
+;     | 16 ... ptr to words  |
+;     | 16 ptr to EXIT       |
+;     +----------------------+
+; note: this whole trick is much simpler since everything is just 16-bit cells.
+; we don't have to worry much about alignment, funky instruction sizes, etc.,
+; and there's no memory protection, so we can jit the does dispatch wherever
+; we want. when direct-threaded, the code field of the child word is itself a
+; jsr to the dispatch, so the data field is right under the does-handler on
+; the stack.
+
+dodoes:     set a, pop              ; stash the word following the jsr dispatch
+            set push, y              ; now that a is safe, push y
+            sub z, 1                ; push the data field of the child word
+            set [z], x
+            add [z], 1
+            set y, a                ; and now begin executing the does> body
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+
+            ; and here's the funky little piece of code that compiles the
+            ; actual dispatch instruction for the does-handler.
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_createdoes:    dw 0
+            
+            dw 11
+            dzw "create-does"
+createdoes:         
+            dw code_createdoes
+code_createdoes:
+            set x, dhcode_          ; start of does-handler dispatch
+cdoes.1:    set j, [x]              ; setup...
+            jsr comma_              ; compile the word in j
+            add x, 1
+            ifg dhend_, x           ; until the end of the dispatch
+            set pc, cdoes.1
+            set x, [y]
+            add y, 1
+            set pc, [x]
+dhcode_:    jsr dodoes
+dhend_:     ; just in case the jsr is 2 words...
+
+; built-in constants and variables...
+; 'latest' and 'h' are defined at the very end, so they can be properly
+; initialized...
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_tib:    dw name_createdoes
+            
+            dw 3
+            dzw "tib"
+tib:         
+            dw docon
+            dw 0xf000
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_inptr:    dw name_tib
+            
+            dw 3
+            dzw ">in"
+inptr:         
+            dw dovar
+var_inptr:     dw 0
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_srcptr:    dw name_inptr
+            
+            dw 6
+            dzw "srcptr"
+srcptr:         
+            dw dovar
+var_srcptr:     dw 0
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_srclen:    dw name_srcptr
+            
+            dw 6
+            dzw "srclen"
+srclen:         
+            dw dovar
+var_srclen:     dw 0
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_state:    dw name_srclen
+            
+            dw 5
+            dzw "state"
+state:         
+            dw dovar
+var_state:     dw 0
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_r0:    dw name_state
+            
+            dw 2
+            dzw "r0"
+r0:         
+            dw dovar
+var_r0:     dw 0x0000
+
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_s0:    dw name_r0
+            
+            dw 2
+            dzw "s0"
+s0:         
+            dw dovar
+var_s0:     dw 0xf000
+
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_base:    dw name_s0
+            
+            dw 4
+            dzw "base"
+base:         
+            dw dovar
+var_base:     dw 10
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_conattr:    dw name_base
+            
+            dw 7
+            dzw "conattr"
+conattr:         
+            dw dovar
+var_conattr:     dw 32
+
+; we also reflect the addresses of the xt values for 'see', custom compiling
+; words, etc...
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_docolf:    dw name_conattr
+            
+            dw 6
+            dzw "docol:"
+docolf:         
+            dw docon
+            dw docol
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_dovarf:    dw name_docolf
+            
+            dw 6
+            dzw "dovar:"
+dovarf:         
+            dw docon
+            dw dovar
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_doconf:    dw name_dovarf
+            
+            dw 6
+            dzw "docon:"
+doconf:         
+            dw docon
+            dw docon
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_dodoesf:    dw name_doconf
+            
+            dw 7
+            dzw "dodoes:"
+dodoesf:         
+            dw docon
+            dw dodoes
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_lenmaskf:    dw name_dodoesf
+            
+            dw 7
+            dzw "lenmask"
+lenmaskf:         
+            dw docon
+            dw 0x1f
+
+            ; the register holding the top of the stack, or -1 if none
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_topreg:    dw name_lenmaskf
+            
+            dw 12
+            dzw "top-register"
+topreg:         
+            dw docon
+            dw -1
+
+            ; and the one holding the forth y, as it walks the thread
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_threadreg:    dw name_topreg
+            
+            dw 15
+            dzw "thread-register"
+threadreg:         
+            dw docon
+            dw 4
+
+
+
+; now we start right in with a bunch of primitive words...
+
+; stack manipulation:
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_drop:    dw name_threadreg
+            
+            dw 4
+            dzw "drop"
+drop:         
+            dw code_drop
+code_drop:
+            add z, 1
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_swap:    dw name_drop
+            
+            dw 4
+            dzw "swap"
+swap:         
+            dw code_swap
+code_swap:
+            set a, [z]
+            set [z], [1+z]
+            set [1+z], a
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_dup:    dw name_swap
+            
+            dw 3
+            dzw "dup"
+dup:         
+            dw code_dup
+code_dup:
+
+            sub z, 1
+            set [z], [1+z]
+
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_over:    dw name_dup
+            
+            dw 4
+            dzw "over"
+over:         
+            dw code_over
+code_over:
+            sub z, 1
+            set [z], [2+z]
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_rot:    dw name_over
+            
+            dw 3
+            dzw "rot"
+rot:         
+            dw code_rot
+code_rot:
+            set a, [z]
+            set [z], [2+z]
+            set [2+z], [1+z]
+            set [1+z], a
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_nrot:    dw name_rot
+            
+            dw 4
+            dzw "-rot"
+nrot:         
+            dw code_nrot
+code_nrot:
+            set a, [z]
+            set [z], [1+z]
+            set [1+z], [2+z]
+            set [2+z], a
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_twodrop:    dw name_nrot
+            
+            dw 5
+            dzw "2drop"
+twodrop:         
+            dw code_twodrop
+code_twodrop:
+            add z, 2
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_twodup:    dw name_twodrop
+            
+            dw 4
+            dzw "2dup"
+twodup:         
+            dw code_twodup
+code_twodup:
+
+            sub z, 2
+            set [1+z], [3+z]
+            set [z], [2+z]
+
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_twoswap:    dw name_twodup
+            
+            dw 5
+            dzw "2swap"
+twoswap:         
+            dw code_twoswap
+code_twoswap:
+            set a, [z]
+            set b, [1+z]
+            set [z], [2+z]
+            set [1+z], [3+z]
+            set [2+z], a
+            set [3+z], b
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_qdup:    dw name_twoswap
+            
+            dw 4
+            dzw "?dup"
+qdup:         
+            dw code_qdup
+code_qdup:
+
+            ife [z], 0
+            add pc, 2
+            sub z, 1
+            set [z], [1+z]
+
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+; basic arithmetic
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_plus:    dw name_qdup
+            
+            dw 1
+            dzw "+"
+plus:         
+            dw code_plus
+code_plus:
+            add [1+z], [z]
+            add z, 1
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_minus:    dw name_plus
+            
+            dw 1
+            dzw "-"
+minus:         
+            dw code_minus
+code_minus:
+            sub [1+z], [z]
+            add z, 1
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_oneplus:    dw name_minus
+            
+            dw 2
+            dzw "1+"
+oneplus:         
+            dw code_oneplus
+code_oneplus:
+            add [z], 1
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_oneminus:    dw name_oneplus
+            
+            dw 2
+            dzw "1-"
+oneminus:         
+            dw code_oneminus
+code_oneminus:
+            sub [z], 1
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_times:    dw name_oneminus
+            
+            dw 1
+            dzw "*"
+times:         
+            dw code_times
+code_times:
+            mul [1+z], [z]
+            add z, 1
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_udiv:    dw name_times
+            
+            dw 2
+            dzw "u/"
+udiv:         
+            dw code_udiv
+code_udiv:
+            div [1+z], [z]
+            add z, 1
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_udivmod:    dw name_udiv
+            
+            dw 5
+            dzw "u/mod"
+udivmod:         
+            dw code_udivmod
+code_udivmod:
+            set a, [z]
+            set [z], [1+z]
+            mod [1+z], a
+            div [z], a
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            ; signed division is symmetric (truncating). ans allows
+            ; either, it's a holy war and i have no horse in the race.
+            ; but like most forths, i'd rather expose the native machine
+            ; division than roll something else.
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_div:    dw name_udivmod
+            
+            dw 1
+            dzw "/"
+div:         
+            dw code_div
+code_div:
+            dvi [1+z], [z]
+            add z, 1
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            ; 'mod' is really remainder, since it's (rightly) consistent
+            ; with div for negative numbers.
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_mod:    dw name_div
+            
+            dw 3
+            dzw "mod"
+mod:         
+            dw code_mod
+code_mod:
+            mdi [1+z], [z]
+            add z, 1
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_divmod:    dw name_mod
+            
+            dw 4
+            dzw "/mod"
+divmod:         
+            dw code_divmod
+code_divmod:
+            set a, [z]
+            set [z], [1+z]
+            mdi [1+z], a
+            dvi [z], a
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_lshift:    dw name_divmod
+            
+            dw 6
+            dzw "lshift"
+lshift:         
+            dw code_lshift
+code_lshift:
+            shl [1+z], [z]
+            add z, 1
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_rshift:    dw name_lshift
+            
+            dw 6
+            dzw "rshift"
+rshift:         
+            dw code_rshift
+code_rshift:
+            shr [1+z], [z]
+            add z, 1
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_twomul:    dw name_rshift
+            
+            dw 2
+            dzw "2*"
+twomul:         
+            dw code_twomul
+code_twomul:
+            shl [z], 1
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_twodiv:    dw name_twomul
+            
+            dw 2
+            dzw "2/"
+twodiv:         
+            dw code_twodiv
+code_twodiv:
+            asr [z], 1
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_bitand:    dw name_twodiv
+            
+            dw 3
+            dzw "and"
+bitand:         
+            dw code_bitand
+code_bitand:
+            and [1+z], [z]
+            add z, 1
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_bitor:    dw name_bitand
+            
+            dw 2
+            dzw "or"
+bitor:         
+            dw code_bitor
+code_bitor:
+            bor [1+z], [z]
+            add z, 1
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_bitxor:    dw name_bitor
+            
+            dw 3
+            dzw "xor"
+bitxor:         
+            dw code_bitxor
+code_bitxor:
+            xor [1+z], [z]
+            add z, 1
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_bitnot:    dw name_bitxor
+            
+            dw 6
+            dzw "invert"
+bitnot:         
+            dw code_bitnot
+code_bitnot:
+            xor [z], 0xffff
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_negate:    dw name_bitnot
+            
+            dw 6
+            dzw "negate"
+negate:         
+            dw code_negate
+code_negate:
+            xor [z], 0xffff         ; negate
+            add [z], 1
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+; double-cell arithmetic. doubles are ( lo hi ), with the high cell on top,
+; and since the dcpu leaves carries, high products and fractions in ex,
+; none of these need more than a handful of instructions.
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_dplus:    dw name_negate
+            
+            dw 2
+            dzw "d+"
+dplus:         
+            dw code_dplus
+code_dplus:
+            add [3+z], [1+z]          ; low cells, carry in ex
+            adx [2+z], [z]
+            add z, 2
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_dminus:    dw name_dplus
+            
+            dw 2
+            dzw "d-"
+dminus:         
+            dw code_dminus
+code_dminus:
+            sub [3+z], [1+z]          ; low cells, borrow in ex
+            sbx [2+z], [z]
+            add z, 2
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_dnegate:    dw name_dminus
+            
+            dw 7
+            dzw "dnegate"
+dnegate:         
+            dw code_dnegate
+code_dnegate:
+            xor [1+z], 0xffff
+            xor [z], 0xffff
+            add [1+z], 1
+            adx [z], 0
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_umtimes:    dw name_dnegate
+            
+            dw 3
+            dzw "um*"
+umtimes:         
+            dw code_umtimes
+code_umtimes:
+            mul [1+z], [z]
+            set [z], ex
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_mtimes:    dw name_umtimes
+            
+            dw 2
+            dzw "m*"
+mtimes:         
+            dw code_mtimes
+code_mtimes:
+            mli [1+z], [z]
+            set [z], ex
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            ; ( ud u -- urem uquot ). as in ans, the quotient is only
+            ; right if it fits in a cell.
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_umdivmod:    dw name_mtimes
+            
+            dw 6
+            dzw "um/mod"
+umdivmod:         
+            dw code_umdivmod
+code_umdivmod:
+            set a, [z]
+            set b, [1+z]
+            set c, [2+z]
+            mod b, a
+            jsr udiv_
+            add z, 1
+            set [1+z], c
+            set [z], b
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            ; ( ud u -- urem udquot ), for formatting doubles
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_uddivmod:    dw name_umdivmod
+            
+            dw 6
+            dzw "ud/mod"
+uddivmod:         
+            dw code_uddivmod
+code_uddivmod:
+            set a, [z]
+            set b, [1+z]
+            set [z], b
+            div [z], a
+            mod b, a
+            set c, [2+z]
+            jsr udiv_
+            set [1+z], b
+            set [2+z], c
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            ; divide b:c by a, leaving the quotient in b and remainder in c.
+            ; b must be less than a. div leaves (b << 16) / a in ex, so
+            ; that's b:0 divided, and adding in c / a and the remainders of
+            ; both (which fit in one more) gives the rest. clobbers x, j.
+udiv_:      div b, a
+            set b, ex               ; (b << 16) / a
+            set x, b
+            mul x, a
+            set j, 0
+            sub j, x                ; and its remainder, -x mod 2^16
+            set x, c
+            div x, a
+            add b, x
+            mod c, a
+            add c, j                ; the remainders sum to less than 2a
+            ifn ex, 0
+            set pc, udiv_.1
+            ifl c, a
+            set pc, pop
+udiv_.1:    sub c, a
+            add b, 1
+            set pc, pop
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_dless:    dw name_uddivmod
+            
+            dw 2
+            dzw "d<"
+dless:         
+            dw code_dless
+code_dless:
+            set a, 0
+            ifu [2+z], [z]           ; high cells are signed...
+            set a, 0xffff
+            ife [2+z], [z]
+            ifl [3+z], [1+z]          ; ...and low cells aren't
+            set a, 0xffff
+            add z, 3
+            set [z], a
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            ; TODO more...
+
+; comparisons
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_equal:    dw name_dless
+            
+            dw 1
+            dzw "="
+equal:         
+            dw code_equal
+code_equal:
+            set a, 0
+            ife [z], [1+z]
+            set a, 0xffff
+            add z, 1
+            set [z], a
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_nequal:    dw name_equal
+            
+            dw 2
+            dzw "<>"
+nequal:         
+            dw code_nequal
+code_nequal:
+            set a, 0
+            ifn [z], [1+z]
+            set a, 0xffff
+            add z, 1
+            set [z], a
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_less:    dw name_nequal
+            
+            dw 1
+            dzw "<"
+less:         
+            dw code_less
+code_less:
+            set a, 0
+            add [z], 0x8000
+            add [1+z], 0x8000
+            ifg [z], [1+z]
+            set a, 0xffff
+            add z, 1
+            set [z], a
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_gt:    dw name_less
+            
+            dw 1
+            dzw ">"
+gt:         
+            dw code_gt
+code_gt:
+            set a, 0
+            add [z], 0x8000
+            add [1+z], 0x8000
+            ifg [1+z], [z]
+            set a, 0xffff
+            add z, 1
+            set [z], a
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_uless:    dw name_gt
+            
+            dw 2
+            dzw "u<"
+uless:         
+            dw code_uless
+code_uless:
+            set a, 0
+            ifg [z], [1+z]
+            set a, 0xffff
+            add z, 1
+            set [z], a
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_ugt:    dw name_uless
+            
+            dw 2
+            dzw "u>"
+ugt:         
+            dw code_ugt
+code_ugt:
+            set a, 0
+            ifg [1+z], [z]
+            set a, 0xffff
+            add z, 1
+            set [z], a
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_ulteq:    dw name_ugt
+            
+            dw 3
+            dzw "u<="
+ulteq:         
+            dw code_ulteq
+code_ulteq:
+            set a, 0
+            ifg [z], [1+z]
+            set a, 0xffff
+            ife [z], [1+z]
+            set a, 0xffff
+            add z, 1
+            set [z], a
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_ugteq:    dw name_ulteq
+            
+            dw 3
+            dzw "u>="
+ugteq:         
+            dw code_ugteq
+code_ugteq:
+            set a, 0
+            ifg [1+z], [z]
+            set a, 0xffff
+            ife [1+z], [z]
+            set a, 0xffff
+            add z, 1
+            set [z], a
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_zequ:    dw name_ugteq
+            
+            dw 2
+            dzw "0="
+zequ:         
+            dw code_zequ
+code_zequ:
+            ife [z], 0
+            set pc, zequ.1
+            set [z], 0
+            set x, [y]
+            add y, 1
+            set pc, [x]
+zequ.1:     set [z], 0xffff
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            ; TODO more...
+
+; internals, execution
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_exit:    dw name_zequ
+            
+            dw 4
+            dzw "exit"
+exit:         
+            dw code_exit
+code_exit:
+            set y, pop
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_lit:    dw name_exit
+            
+            dw 3
+            dzw "lit"
+lit:         
+            dw code_lit
+code_lit:
+            ; push the value at the forth y and advance it
+            sub z, 1
+            set [z], [y]
+            add y, 1
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_litstring:    dw name_lit
+            
+            dw 9
+            dzw "litstring"
+litstring:         
+            dw code_litstring
+code_litstring:
+            ; push the count and following string from the forth y
+            sub z, 2
+            set [z], [y]
+            set [1+z], y
+            add [1+z], 1
+            add y, [y]
+            add y, 1
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_execute:    dw name_litstring
+            
+            dw 7
+            dzw "execute"
+execute:         
+            dw code_execute
+code_execute:
+            set x, [z]              ; get xt from stack
+            add z, 1                 ; and pop it
+            set pc, [x]                  ; execute
+            ; nb: no next!
+
+; memory
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_store:    dw name_execute
+            
+            dw 1
+            dzw "!"
+store:         
+            dw code_store
+code_store:
+            set a, [z]              ; fetch destination address
+            set [a], [1+z]            ; store the next stack value to dest
+            add z, 2                 ; pop both values
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_fetch:    dw name_store
+            
+            dw 1
+            dzw "@"
+fetch:         
+            dw code_fetch
+code_fetch:
+            set a, [z]              ; fetch source address
+            set [z], [a]            ; read, replace top of stack
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_addstore:    dw name_fetch
+            
+            dw 2
+            dzw "+!"
+addstore:         
+            dw code_addstore
+code_addstore:
+            set a, [z]              ; fetch destination address
+            add [a], [1+z]            ; add next value to dest
+            add z, 2                 ; pop both values
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_substore:    dw name_addstore
+            
+            dw 2
+            dzw "-!"
+substore:         
+            dw code_substore
+code_substore:
+            set a, [z]              ; fetch destination address
+            sub [a], [1+z]            ; subtract next value from dest
+            add z, 2                 ; pop both values
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            ; ( src dest u -- )
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_move:    dw name_substore
+            
+            dw 4
+            dzw "move"
+move:         
+            dw code_move
+code_move:
+            set a, [2+z]             ; src in a
+            set b, [1+z]              ; dest in b
+            set c, b                ; limit in c
+            add c, [z]
+            add z, 3                 ; pop args
+move.2:     ife b, c                ; done?
+            set pc, move.1
+            set [b], [a]            ; assign
+            add a, 1                ; increment
+            add b, 1
+            set pc, move.2          ; again...
+move.1:     set x, [y]
+            add y, 1
+            set pc, [x]
+
+; direct stack access
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_tor:    dw name_move
+            
+            dw 2
+            dzw ">r"
+tor:         
+            dw code_tor
+code_tor:
+            set push, [z]
+            add z, 1
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_fromr:    dw name_tor
+            
+            dw 2
+            dzw "r>"
+fromr:         
+            dw code_fromr
+code_fromr:
+            sub z, 1
+            set [z], pop
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_rpeek:    dw name_fromr
+            
+            dw 2
+            dzw "r@"
+rpeek:         
+            dw code_rpeek
+code_rpeek:
+            sub z, 1
+            set [z], peek
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_rdrop:    dw name_rpeek
+            
+            dw 5
+            dzw "rdrop"
+rdrop:         
+            dw code_rdrop
+code_rdrop:
+            set a, pop               ; destination is irrelevant
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_twotor:    dw name_rdrop
+            
+            dw 3
+            dzw "2>r"
+twotor:         
+            dw code_twotor
+code_twotor:
+            set push, [1+z]
+            set push, [z]
+            add z, 2
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_twofromr:    dw name_twotor
+            
+            dw 3
+            dzw "2r>"
+twofromr:         
+            dw code_twofromr
+code_twofromr:
+            sub z, 2
+            set [z], pop
+            set [1+z], pop
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_tworpeek:    dw name_twofromr
+            
+            dw 3
+            dzw "2r@"
+tworpeek:         
+            dw code_tworpeek
+code_tworpeek:
+            sub z, 2
+            set [z], peek
+            set [1+z], pick 1
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_twordrop:    dw name_tworpeek
+            
+            dw 6
+            dzw "2rdrop"
+twordrop:         
+            dw code_twordrop
+code_twordrop:
+            set a, pop               ; destination is irrelevant
+            set a, pop               ; destination is irrelevant
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_rspstore:    dw name_twordrop
+            
+            dw 4
+            dzw "rsp!"
+rspstore:         
+            dw code_rspstore
+code_rspstore:
+            set sp, [z]
+            add z, 1
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_rspfetch:    dw name_rspstore
+            
+            dw 4
+            dzw "rsp@"
+rspfetch:         
+            dw code_rspfetch
+code_rspfetch:
+            sub z, 1
+            set [z], sp
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            ; with the top of the stack in a register, these keep up the
+            ; pretence that it sits just below [z], as it would in memory
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_dspstore:    dw name_rspfetch
+            
+            dw 4
+            dzw "dsp!"
+dspstore:         
+            dw code_dspstore
+code_dspstore:
+
+            set z, [z]
+
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_dspfetch:    dw name_dspstore
+            
+            dw 4
+            dzw "dsp@"
+dspfetch:         
+            dw code_dspfetch
+code_dspfetch:
+
+            set a, z
+            sub z, 1
+            set [z], a
+
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_branch:    dw name_dspfetch
+            
+            dw 6
+            dzw "branch"
+branch:         
+            dw code_branch
+code_branch:
+            add y, [y]
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_zbranch:    dw name_branch
+            
+            dw 7
+            dzw "0branch"
+zbranch:         
+            dw code_zbranch
+code_zbranch:
+            ife [z], 0              ; check condition
+            set pc, zbranch.1
+            add z, 1                 ; pop
+            add y, 1               ; skip offset
+            set x, [y]
+            add y, 1
+            set pc, [x]
+zbranch.1:  add z, 1                 ; pop
+            add y, [y]            ; take the branch
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+; i/o
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_dumpcore:    dw name_zbranch
+            
+            dw 9
+            dzw "dump-core"
+dumpcore:         
+            dw code_dumpcore
+code_dumpcore:
+            img [z]                 ; dump. expects limit address on stack
+            add z, 1                 ; pop arg
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_bye:    dw name_dumpcore
+            
+            dw 3
+            dzw "bye"
+bye:         
+            dw code_bye
+code_bye:
+            die 0                   ; make vm exit.
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_debug:    dw name_bye
+            
+            dw 5
+            dzw "debug"
+debug:         
+            dw code_debug
+code_debug:
+            dbg 0                   ; enter emulator debugger
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+
+            ; waits for a keypress. returns key in c.
+            ; the keyboard interrupt handler below queues keys in kbuf. when
+            ; there are none, we ask the keyboard once, in case one was left
+            ; there while kbuf was full, and otherwise wait in a loop of a
+            ; single instruction. the emulator takes that as the cpu idling
+            ; until an interrupt comes, and the handler breaks us out of it.
+            ; interrupts are held while we look, so that any key that turns
+            ; up meanwhile is handled exactly at idle_, and wakes us.
+readkey:    iaq 1
+            ifn [kbuf_r], [kbuf_w]  ; anything queued?
+            set pc, readkey.1
+            set push, a             ; save
+            set a, 1                ; a == 1: read key into c
+            hwi [kbd]               ; do the interrupt
+            set a, pop              ; restore
+            ifn c, 0
+            set pc, readkey.2
+            jsr others_             ; anything else to do meanwhile?
+            ifn c, 0
+            set pc, readkey.3
+            iaq 0
+idle_:      sub pc, 1               ; wait...
+            set pc, readkey         ; and look again
+readkey.3:  jsr pause_              ; let the other tasks run first
+            set pc, readkey
+readkey.1:  set c, [kbuf_r]
+            and c, 15
+            set c, [kbuf+c]
+            add [kbuf_r], 1
+readkey.2:  iaq 0
+            set pc, pop
+
+            ; interrupts come here. the keyboard sends 1 and the clock 2
+int_:       ife a, 2
+            set pc, clockint_
+
+            ; keyboard interrupt handler. the keyboard interrupts once per
+            ; key, so we take one key into kbuf each time, if there is room.
+            ; a (already saved by the interrupt) and c are all we use, and
+            ; ex is saved too, since the arithmetic here would clobber a
+            ; carry the interrupted code hasn't picked up yet. this all
+            ; costs some 20 cycles a key more than polling did, which is
+            ; nothing beside typing, but bootstrapping takes 12-17% longer.
+kbdint_:    set push, ex
+            set push, c
+            set a, [kbuf_w]
+            sub a, [kbuf_r]
+            ife a, 16         ; full? leave the key for readkey
+            set pc, kbdint_.1
+            set a, 1                ; a == 1: read key into c
+            hwi [kbd]
+            ife c, 0                ; readkey got to it first
+            set pc, kbdint_.1
+            set a, [kbuf_w]
+            and a, 15
+            set [kbuf+a], c
+            add [kbuf_w], 1
+kbdint_.1:  ife pick 3, idle_       ; if readkey is waiting, wake it up
+            add pick 3, 1
+            set c, pop
+            set ex, pop
+            rfi 0
+
+; tasks. each has a block of 10 cells, its tcb:
+;     +----------------------+
+;     | 16 following task    |<--- tcb
+;     | 16 saved sp          |
+;     | 16 awake?            |
+;     | 16 s0                |
+;     | 16 r0                |
+;     | 16 base              |
+;     | 16 ... 4 cells of    |
+;     |    thread to start   |
+;     +----------------------+
+; the tasks make a ring, which starts out with just the boot task. pause
+; gives way to the first task after this one that's awake, and waiting for
+; a key pauses too, if there's anything else to do. so does the clock
+; interrupt, after preempt. either way, everything a task has in registers
+; goes on its own return stack, in the frame an interrupt starts:
+;     ex j i z y x c b a pc
+; so whichever way a task stopped, switch_ can start it again with rfi. s0,
+; r0 and base are kept per task, too.
+task0:      dw 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+
+            ; switch to the following task that's awake, or carry on if there
+            ; isn't one. expects the frame above, apart from a and pc, to
+            ; be pushed, with interrupts queued.
+switch_:    set push, b
+            set push, c
+            set push, x
+            set push, y
+            set push, z
+            set push, i
+            set push, j
+            set push, ex
+            set a, [var_thistask]
+            set [1+a], sp
+            set [3+a], [var_s0]
+            set [4+a], [var_r0]
+            set [5+a], [var_base]
+            set b, a
+switch_.1:  set a, [a]              ; on to the one after
+            ife a, b                ; all the way round? then stay
+            set pc, switch_.2
+            ife [2+a], 0            ; asleep?
+            set pc, switch_.1
+switch_.2:  set [var_thistask], a
+            set sp, [1+a]
+            set [var_s0], [3+a]
+            set [var_r0], [4+a]
+            set [var_base], [5+a]
+            set ex, pop
+            set j, pop
+            set i, pop
+            set z, pop
+            set y, pop
+            set x, pop
+            set c, pop
+            set b, pop
+            rfi 0
+
+            ; the same, called from native code
+pause_:     iaq 1
+            set push, a
+            set pc, switch_
+
+            ; is any other task awake? c is nonzero if so
+others_:    set c, [var_thistask]
+others_.1:  set c, [c]
+            ife c, [var_thistask]
+            set pc, others_.2
+            ife [2+c], 0
+            set pc, others_.1
+            set pc, pop
+others_.2:  set c, 0
+            set pc, pop
+
+            ; clock interrupt handler. the clock only interrupts when
+            ; preempt has turned it on, and then it's another task's
+            ; turn. one caught waiting for a key will look again when it
+            ; comes back, as in kbdint_.
+clockint_:  ife pick 1, idle_
+            add pick 1, 1
+            set pc, switch_
+
+            ; a new task starts here, with the forth y on the thread in
+            ; its tcb
+taskstart_: set x, [y]
+            add y, 1
+            set pc, [x]
+
+            ; the running task, and the one that booted
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_thistask:    dw name_debug
+            
+            dw 9
+            dzw "this-task"
+thistask:         
+            dw dovar
+var_thistask:     dw task0
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_maintask:    dw name_thistask
+            
+            dw 9
+            dzw "main-task"
+maintask:         
+            dw docon
+            dw task0
+
+
+            ; ( -- )  give the other tasks a turn
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_pause:    dw name_maintask
+            
+            dw 5
+            dzw "pause"
+pause:         
+            dw code_pause
+code_pause:
+            jsr pause_
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            ; ( -- )  put this task to sleep, until another one wakes it
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_stop:    dw name_pause
+            
+            dw 4
+            dzw "stop"
+stop:         
+            dw code_stop
+code_stop:
+            set a, [var_thistask]
+            set [2+a], 0
+            jsr pause_
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            ; ( task -- )
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_wake:    dw name_stop
+            
+            dw 4
+            dzw "wake"
+wake:         
+            dw code_wake
+code_wake:
+            set a, [z]
+            set [2+a], 1
+            add z, 1
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            ; ( task -- )
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_sleep:    dw name_wake
+            
+            dw 5
+            dzw "sleep"
+sleep:         
+            dw code_sleep
+code_sleep:
+            set a, [z]
+            set [2+a], 0
+            add z, 1
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            ; ( xt task -- )  start a task running xt, with empty stacks,
+            ; once this one pauses. if xt returns, the task stops for good.
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_activate:    dw name_sleep
+            
+            dw 8
+            dzw "activate"
+activate:         
+            dw code_activate
+code_activate:
+            iaq 1                   ; the ring has to hold still
+            set a, [z]
+            set [6+a], [1+z]          ; the thread: xt, then stop forever
+            set [7+a], stop
+            set [8+a], branch
+            set [9+a], 0xfffe
+            set b, [4+a]            ; a frame to start from, on its
+            sub b, 10               ; return stack
+            set [1+a], b
+            set [3+b], [3+a]        ; z at the base of its data stack
+
+
+            set [4+b], a            ; y, the thread pointer, on it
+            add [4+b], 6
+
+            set [9+b], taskstart_
+            set [2+a], 1            ; awake
+            set b, [var_thistask]   ; is it in the ring already?
+activate.1: ife b, a
+            set pc, activate.2
+            set b, [b]
+            ifn b, [var_thistask]
+            set pc, activate.1
+            set b, [var_thistask]   ; if not, it goes after this one
+            set [a], [b]
+            set [b], a
+activate.2: iaq 0
+            add z, 2
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            ; ( n -- )  have the clock switch tasks every n 60ths of a
+            ; second, or not at all if n is 0. without a clock, does nothing.
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_preempt:    dw name_activate
+            
+            dw 7
+            dzw "preempt"
+preempt:         
+            dw code_preempt
+code_preempt:
+            ife [clock], 0xffff
+            set pc, preempt.1
+            set a, 0                ; a == 0: set the tick rate to b
+            set b, [z]
+            hwi [clock]
+            set a, 2                ; a == 2: interrupt with message b
+            set b, 2
+            ife [z], 0
+            set b, 0
+            hwi [clock]
+preempt.1:  add z, 1
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_key:    dw name_preempt
+            
+            dw 3
+            dzw "key"
+key:         
+            dw code_key
+code_key:
+            sub z, 1
+            jsr readkey             ; fetch keypress
+            set j, c
+            set [z], j
+            jsr emit_               ; echo j to the terminal
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_emit:    dw name_key
+            
+            dw 4
+            dzw "emit"
+emit:         
+            dw code_emit
+code_emit:
+            set j, [z]              ; prep the call
+            add z, 1                 ; and pop it
+            jsr emit_               ; write the char
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_setborder:    dw name_emit
+            
+            dw 7
+            dzw "border!"
+setborder:         
+            dw code_setborder
+code_setborder:
+            set a, 3                ; a == 3: SET_BORDER_COLOR
+            set b, [z]              ; b contains border palette idx
+            hwi [display]
+            add z, 1                 ; pop it
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            ; ( -- ud )  emulated cycles since boot. this is an extension to
+            ; the clock (see README); on any other, it is always 0.
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_cycles:    dw name_setborder
+            
+            dw 6
+            dzw "cycles"
+cycles:         
+            dw code_cycles
+code_cycles:
+            set b, 0
+            set c, 0
+            set a, 0x10             ; a == 0x10: cycles into b:c
+            ifn [clock], 0xffff
+            hwi [clock]
+            sub z, 2
+            set [1+z], c
+            set [z], b
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            ; writes the word in j to vidram. handles scrolling, newline,
+            ; and backspace. uses register x. interrupts are held
+            ; meanwhile, so that the clock can't switch to another task
+            ; halfway through.
+emit_:      iaq 1
+            ifn j, 0x11             ; check nl
+            set pc, emit_.1
+            set x, [curvid]         ; erase cursor
+            add x, 0x8000
+            set [x], 0
+            add [curvid], 31        ; next line. nb, this only works if line
+            and [curvid], -32       ; width is a power of 2
+            set [curline], [curvid] ; set start of current line (for backspace)
+            set pc, emit_.3
+emit_.1:    ifn j, 0x10             ; check bs
+            set pc, emit_.2
+            ife [curline], [curvid] ; at line start. bail.
+            set pc, emit_.3
+            ife [curline], 0        ; at start of vidram. vanishingly unlikely,
+            set pc, emit_.3         ;    but just in case... bail.
+            sub [curvid], 1         ; do the backspace
+            set x, [curvid]         ; prep rubout
+            add x, 0x8000
+            set [x], 0              ; rubout the char
+            set [1+x], 0            ; rubout the cursor
+            set pc, emit_.3
+emit_.2:    set x, [curvid]         ; load next vidram slot
+            add x, 0x8000
+            set [x], [var_conattr]  ; set terminal attributes
+            shl [x], 7
+            bor [x], j              ; write the char
+            add [curvid], 1         ; advance
+emit_.3:    ife [curvid], [vidend]  ; we'll always hit the number exactly...
+            jsr scroll_
+            set x, [curvid]
+            add x, 0x8000
+            set [x], [var_conattr]  ; set terminal attributes
+            bor [x], 1              ; the cursor always blinks
+            shl [x], 7
+            bor [x], 0x5f           ; show cursor
+            iaq 0
+            set pc, pop
+
+            ; scroll the screen. uses x and j. rather than copying the
+            ; whole screen up a line, this just blanks the line below the
+            ; window and moves the display down onto it. only when the
+            ; window reaches the end of the buffer do we copy it back to the
+            ; start, once every 20 lines. a line printed on a full screen
+            ; costs about 650 cycles, copying included, instead of 3,600.
+scroll_:    ife [vidend], 0x0400 ; out of buffer?
+            set pc, scroll_.3
+            set x, [vidend]
+            add x, 0x8000
+            add [vidend], 32
+            set pc, scroll_.4
+scroll_.3:  set j, 0x8000          ; limit in j
+            add j, 352
+            set x, 0x8000          ; copy all but the top line back
+scroll_.1:  set [x], [672+x]
+            add x, 1
+            ifg j, x
+            set pc, scroll_.1
+            set [vidend], 0x0180
+            sub [curvid], 672
+            sub [curline], 672
+scroll_.4:  set j, x                ; blank the new last line
+            add j, 32
+scroll_.2:  set [x], 0
+            add x, 1
+            ifg j, x
+            set pc, scroll_.2
+            set push, a             ; and show the window from its new start
+            set push, b
+            set a, 0                ; a == 0: MEM_MAP_SCREEN
+            set b, [vidend]
+            add b, 32384
+            hwi [display]
+            set b, pop
+            set a, pop
+            set pc, pop
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_cr:    dw name_cycles
+            
+            dw 2
+            dzw "cr"
+cr:         
+            dw code_cr
+code_cr:
+            set j, 0x11
+            jsr emit_
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            ; ( a u1 -- u2 )
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_accept:    dw name_cr
+            
+            dw 6
+            dzw "accept"
+accept:         
+            dw code_accept
+code_accept:
+            set a, [1+z]              ; dest addr in a
+            add [z], a              ; limit addr in [z]
+accept.1:   ife a, [z]              ; bail if at limit
+            set pc, accept.2
+accept.3:   jsr readkey             ; fetch keypress
+            set j, c                ; the emits below expect key in j...
+            set [a], c
+            ifn [a], 0x10           ; skip if not backspace/delete
+            set pc, accept.4
+            jsr emit_               ; erase from the terminal
+            ifg a, [1+z]              ; backspace input buffer, if possible
+            sub a, 1
+            set pc, accept.3        ; ...and try again
+accept.4:   ife [a], 0x11           ; bail if newline
+            set pc, accept.2
+            jsr emit_               ; echo it to the terminal, key is still in j
+            add a, 1
+            set pc, accept.1
+accept.2:   set j, 0x20             ; echo a space
+            jsr emit_
+            sub a, [1+z]              ; compute length
+            add z, 1                ; pop 1 arg
+            set [z], a              ; push it
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            ; TODO handle non-printing chars
+            ; ( a u -- )
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_type:    dw name_accept
+            
+            dw 4
+            dzw "type"
+type:         
+            dw code_type
+code_type:
+            set a, [1+z]              ; src addr in a
+            add [z], a              ; limit addr in [z]
+type.1:     ife a, [z]              ; bail if at limit
+            set pc, type.2
+            set j, [a]              ; write char
+            jsr emit_
+            add a, 1
+            set pc, type.1
+type.2:     add z, 2                 ; pop args
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            ; ( -- ? )
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_refill:    dw name_type
+            
+            dw 6
+            dzw "refill"
+refill:         
+            dw docol
+            dw tib
+            dw dup, srcptr, store   ; set srcptr to tib
+            dw lit, 256, accept     ; read line into tib
+            dw srclen, store        ; set srclen to result
+            dw lit, 0, inptr, store ; set >in to 0
+            dw lit, 0xffff          ; push true
+            dw exit
+
+            ; ( -- a len )
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_source:    dw name_refill
+            
+            dw 6
+            dzw "source"
+source:         
+            dw docol
+            dw srcptr, fetch        ; push ptr and len
+            dw srclen, fetch
+            dw exit
+
+
+; parsing, compiling
+
+            ; expects address of string in a, returns bool in j
+isspace_:   set j, 0
+            ife [a], 0x20           ; space
+            set j, -1
+            ife [a], 0x09           ; tab
+            set j, -1
+            ife [a], 0x11           ; newline
+            set j, -1
+            set pc, pop
+
+            ; Takes address of character in b and lowers it in-place.
+lower_:     ifl [b], 0x5b
+            ifg [b], 0x40
+            add [b], 0x20 ; Shift the character from upper- to lowercase.
+            set pc, pop
+
+            ; expects address of string in a, upper limit in c
+dropspace_: ife a, c
+            set pc, pop             ; input exhausted, bail
+            jsr isspace_            ; space? result in j
+            ife j, 0                ; not a space, return
+            set pc, pop
+            add a, 1                ; next char
+            set pc, dropspace_
+
+            ; ( char "ccc<char>" -- a u )
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_parse:    dw name_source
+            
+            dw 5
+            dzw "parse"
+parse:         
+            dw code_parse
+code_parse:
+            set x, [z]              ; load terminator
+            sub z, 1                ; we'll have one more result than arg
+            set a, [var_srcptr]     ; load srcptr
+            set c, a
+            add c, [var_srclen]     ; store limit in c
+            add a, [var_inptr]      ; add >in, a is current parse location
+            jsr dropspace_          ; ignore initial whitespace
+parse.2:    set [1+z], a              ; push start of word
+parse.3:    ife a, c
+            set pc, parse.end       ; input exhausted, bail
+            ife [a], x              ; check for terminator
+            set pc, parse.end2      ; if found, done!
+            add a, 1
+            set pc, parse.3
+            ; TODO this is some ugly duplication, but it's late and i don't
+            ; care enough to fix it right now. the only difference between
+            ; the next two snippets is the "add a, 1" in the middle.
+parse.end2: set [z], a              ; push parsed length
+            sub [z], [1+z]
+            add a, 1                ; include terminator
+            set [var_inptr], a      ; store next location back to >in
+            sub [var_inptr], [var_srcptr]
+            set x, [y]
+            add y, 1
+            set pc, [x]
+parse.end:  set [z], a              ; push parsed length
+            sub [z], [1+z]
+            set [var_inptr], a      ; store next location back to >in
+            sub [var_inptr], [var_srcptr]
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            ; ( "<spaces>name" -- a u )
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_parseword:    dw name_parse
+            
+            dw 10
+            dzw "parse-word"
+parseword:         
+            dw code_parseword
+code_parseword:
+            sub z, 2                ; we'll have two results
+            set a, [var_srcptr]     ; load srcptr
+            set c, a
+            add c, [var_srclen]     ; store limit in c
+            add a, [var_inptr]      ; add >in, a is current parse location
+            jsr dropspace_          ; ignore initial whitespace
+pword.2:    set [1+z], a              ; push start of word
+pword.3:    ife a, c
+            set pc, pword.end       ; input exhausted, bail
+            jsr isspace_            ; space? result in j
+            ifn j, 0
+            set pc, pword.end       ; space, all done!
+            add a, 1
+            set pc, pword.3
+pword.end:  set [z], a              ; push parsed length
+            sub [z], [1+z]
+            set [var_inptr], a      ; store next location back to >in
+            sub [var_inptr], [var_srcptr]
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            ; convert word to number. word len in a, ptr in b, accumulator in x.
+            ; modifies i, advances b and decrements a as it parses...
+tonum_:     ife a, 0                ; bail if exhausted
+            set pc, tonum_.end
+            ifg [b], 0x39           ; Try a character if char > '9'
+            set pc, tonum_.chr
+            ifg 0x30, [b]           ; bail if char < '0'
+            set pc, tonum_.end
+            set j, [b]
+            sub j, 0x30             ; remove '0'
+tonum_.mul: ifg j, [var_base]       ; bail if not a digit in current base
+            set pc, tonum_.end
+            ife j, [var_base]
+            set pc, tonum_.end
+            mul x, [var_base]       ; shift x one place
+            add x, j                ; add it
+            sub a, 1                ; advance to next char
+            add b, 1
+            set pc, tonum_          ; and begin again...
+tonum_.chr: jsr lower_              ; Lower the character.
+            ifg [b], 0x7a           ; Not a lowercase character.
+            set pc, tonum_.end
+            ifg 0x61, [b]           ; Also not a lowercase character.
+            set pc, tonum_.end
+            set j, [b]
+            sub j, 0x57
+            set pc, tonum_.mul
+tonum_.end: set pc, pop
+
+            ; >number ( u1 a1 u1 -- u2 a2 u2 )
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_tonumber:    dw name_parseword
+            
+            dw 7
+            dzw ">number"
+tonumber:         
+            dw code_tonumber
+code_tonumber:
+            set a, [z]
+            set b, [1+z]
+            set x, [2+z]
+            jsr number_
+            set [2+z], x
+            set [1+z], b
+            set [z], a
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            ; convert word to number, possibly negative.
+            ; takes word len in a, ptr in b.
+            ; accumulates result in x, advances b and decrements a as it parses...
+number_:    set push, 0             ; number is positive
+            ife a, 0                ; bail if exhausted
+            set pc, numb_.end
+            ifn [b], 0x2d           ; if first char is '-'
+            set pc, numb_.pos
+            set peek, 1             ; number is negative
+            sub a, 1                ; skip '-'
+            add b, 1
+numb_.pos:  jsr tonum_
+numb_.end:  ife 0, pop              ; if positive, we're done
+            set pc, pop
+            xor x, 0xffff           ; else negate
+            add x, 1
+            set pc, pop
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_allot:    dw name_tonumber
+            
+            dw 5
+            dzw "allot"
+allot:         
+            dw docol
+            dw h, addstore          ; increment h
+            dw exit
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_create:    dw name_allot
+            
+            dw 6
+            dzw "create"
+create:         
+            dw docol
+            dw lit, 0, comma        ; compile empty hash chain
+            dw here                 ; save current h
+            dw latest, fetch, comma ; compile name_create ptr
+            dw latest, store        ; update latest
+            dw parseword            ; parse a word TODO check for empty!
+            dw dup, comma           ; compile name length
+            dw here, swap           ; set up to copy, stack ( src dest n -- )
+            dw dup, allot           ; advance h first
+            dw move                 ; copy name
+
+            dw lit, dovar, comma    ; compile the cfa
+
+            dw latest, fetch        ; and add it to the index
+            dw hashword
+            dw exit
+
+            ; ( addr -- )  toggles hidden given dict entry
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_hidden:    dw name_create
+            
+            dw 6
+            dzw "hidden"
+hidden:         
+            dw code_hidden
+code_hidden:
+            set a, [z]
+            add a, 1                ; find flags/len
+            xor [a], 0x20       ; toggle
+            add z, 1                 ; pop
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_immediate:    dw name_hidden
+            
+            dw 137
+            dzw "immediate"
+immediate:         
+            dw code_immediate
+code_immediate:
+            set a, [var_latest]     ; get latest
+            add a, 1                ; find flags/len
+            xor [a], 0x80        ; toggle
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_here:    dw name_immediate
+            
+            dw 4
+            dzw "here"
+here:         
+            dw docol
+            dw h, fetch
+            dw exit
+
+            ; we've reached the limits of masm's hokey parsing...
+            ; this is just defcode expanded and without dzw:
+            ;defcode(,, 0, comma)
+            dw 0                    ; hash chain
+name_comma: dw name_here
+            
+            dw 1                    ; no flags, length 1
+            dw 0x2c                 ; comma
+comma:      dw code_comma
+code_comma: ; code follows...
+            set j, [z]              ; set up the call
+            jsr comma_
+            add z, 1                 ; pop stack
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            ; factored out so we can also call it natively.
+            ; expects word to compile in j
+comma_:     set b, [var_h]          ; fetch next dest
+            set [b], j              ; write the value
+            add [var_h], 1          ; increment h
+            set pc, pop
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_lbrac:    dw name_comma
+            
+            dw 129
+            dzw "["
+lbrac:         
+            dw code_lbrac
+code_lbrac:
+            set [var_state], 0      ; done compiling
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_rbrac:    dw name_lbrac
+            
+            dw 1
+            dzw "]"
+rbrac:         
+            dw docol
+            dw lit, 1, state, store ; begin compiling
+            dw parseword
+            dw dup, zbranch, 12     ; done?
+            dw compile_             ; call the primitive
+            dw succ, fetch
+            dw zbranch, 9           ; error, nothing to drop, just bail
+            dw state, fetch         ; must retest state flag, an immediate word
+            dw zbranch, 4           ;   can change it...
+            dw branch, -14
+            dw twodrop
+            dw exit
+            ; TODO error handling! really we should abort here or whatever...
+            dw lit, 0x65, emit      ; but for now, we can at least spew an 'e'
+            dw exit
+
+            ; this can't return anything, since execution will cause us to
+            ; eventually next our way back into forth code. we could make
+            ; it work by fiddling around with the forth y, but it doesn't seem
+            ; worth it... we use a var to communicate errors...
+            ; ( a u -- )
+compile_:   dw compile__
+compile__:  set a, [z]              ; load length
+            set b, [1+z]              ; load ptr
+            add z, 2
+            set [var_succ], 0xffff
+            jsr find_               ; dictionary search, results in x, j
+            ifn [var_compiler], 0
+            set pc, compile_.5      ; someone else is compiling...
+            ife x, 0
+            set pc, compile_.1      ; not in dict...
+            ife x, 1
+            set pc, compile_.4      ; not an immediate word.
+            set x, j                ; immediate word. update the codeword pointer
+            set pc, [x]                  ; and execute it...
+compile_.4: jsr comma_              ; non-immediate. compile the value in j.
+            set pc, compile_.3
+compile_.1: set x, 0                ; no accumulator so far...
+            jsr number_
+            ife a, 0
+            set pc, compile_.2
+            set [var_succ], 0x0     ; not a number. bail.
+            set pc, compile_.3
+compile_.2: set j, lit
+            jsr comma_              ; compile ptr to 'lit'
+            set j, x
+            jsr comma_              ; compile the numeric value in j
+compile_.3: set x, [y]
+            add y, 1
+            set pc, [x]
+compile_.5: ife x, 0
+            set pc, compile_.7      ; not in dict, so it had better be a number
+compile_.6: sub z, 2                ; ( xt 1 | xt -1 | n 0 ), as from find
+            set [1+z], j
+            set [z], x
+            set x, [var_compiler]
+            set pc, [x]                  ; and hand it over
+compile_.7: jsr number_             ; x is already 0
+            ife a, 0
+            set pc, compile_.8
+            set [var_succ], 0x0     ; not a number. bail.
+            set x, [y]
+            add y, 1
+            set pc, [x]
+compile_.8: set j, x
+            set x, 0
+            set pc, compile_.6
+
+            ; if set, the xt of a word that does the compiling in ] instead.
+            ; it gets the result of find, or a number and 0.
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_compiler:    dw name_rbrac
+            
+            dw 8
+            dzw "compiler"
+compiler:         
+            dw dovar
+var_compiler:     dw 0
+
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_colon:    dw name_compiler
+            
+            dw 1
+            dzw ":"
+colon:         
+            dw docol
+            dw create               ; make the dict entry
+            dw latest, fetch        ; grab the addr of created word
+            dw dup, hidden          ; hide it
+            dw tocfa, lit, docol    ; set the codeword
+            dw swap, codeaddrstore
+            dw rbrac                ; compile
+            dw exit
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_semi:    dw name_colon
+            
+            dw 129
+            dzw ";"
+semi:         
+            dw docol
+            dw lit, exit, comma     ; append exit
+            dw latest, fetch, hidden; unhide it
+            dw lbrac                ; stop compiling
+            dw exit
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_variable:    dw name_semi
+            
+            dw 8
+            dzw "variable"
+variable:         
+            dw docol
+            dw create               ; make the dict entry
+            dw lit, 1, allot        ; reserve the space
+            dw exit
+
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_constant:    dw name_variable
+            
+            dw 8
+            dzw "constant"
+constant:         
+            dw docol
+            dw create               ; make the dict entry
+            dw lit, docon           ; set the codeword
+            dw latest, fetch, tocfa
+            dw codeaddrstore
+            dw comma                ; compile the constant
+            dw exit
+
+; dictionary
+            ; ( a u -- 0 0  |  xt 1  |  xt -1 )
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_find:    dw name_constant
+            
+            dw 4
+            dzw "find"
+find:         
+            dw code_find
+code_find:
+            set a, [z]
+            set b, [1+z]
+            jsr find_
+            set [1+z], j
+            set [z], x
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            ; find word in dictionary. word len in a, ptr in b.
+            ; returns xt in j, x = 1, -1, 0 for found, immediate, and not found
+            ; does NOT clobber a or b
+find_:      jsr hash_               ; find the word's bucket
+            set c, [c]              ; start with most recent word in it
+find_.1:    ife c, 0                ; end of chain?
+            set pc, find_.fail
+            set j, [1+c]            ; load flags/len
+            ifb j, 0x20         ; ignore if hidden
+            set pc, find_.2
+            and j, 0x1f        ; mask off flags
+            ifn j, a                ; compare length
+            set pc, find_.2
+
+            set x, b                ; x points into input word
+            set j, c                ; j points into dict word
+            add j, 2
+            set push, x             ; stack gets limit of input word
+            add peek, a
+find_.3:    ife x, peek             ; check for full match
+            set pc, find_.succ
+            ifn [x], [j]
+            set pc, find_.4
+            add x, 1
+            add j, 1
+            set pc, find_.3
+
+find_.4:    set x, pop              ; pop limit, dest doesn't matter
+find_.2:    set c, [-1+c]           ; next word in the chain
+            set pc, find_.1
+
+find_.succ: set x, pop              ; pop limit, dest doesn't matter
+            ; j already points to the xt...
+            set x, 1                ; found
+            ifb [1+c], 0x80      ; immediate?
+            set x, -1               ; if so, mark it
+            set pc, pop
+
+find_.fail: set x, 0
+            set j, 0
+            set pc, pop
+
+            ; hash a word for the dictionary index. word len in a, ptr in b.
+            ; returns the address of the word's bucket in c. clobbers j,
+            ; but not a or b
+hash_:      set push, a             ; a counts down the chars
+            set c, a                ; start with the length
+            set j, b
+hash_.1:    ife a, 0
+            set pc, hash_.2
+            mul c, 31               ; mix in each char
+            add c, [j]
+            add j, 1
+            sub a, 1
+            set pc, hash_.1
+hash_.2:    set a, pop
+            and c, 63
+            add c, buckets
+            set pc, pop
+
+            ; ( addr -- )  adds the dict entry at addr to the index. the
+            ; newest entry always goes at the head of its chain, so find
+            ; sees the same word it would walking the dictionary in order.
+            ; hidden and immediate just change the flags, which find checks
+            ; as it goes, so they don't need to touch the index at all
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_hashword:    dw name_find
+            
+            dw 9
+            dzw "hash-word"
+hashword:         
+            dw code_hashword
+code_hashword:
+            set x, [z]
+            add z, 1                 ; pop
+            set a, [1+x]            ; load len
+            and a, 0x1f
+            set b, x                ; and name
+            add b, 2
+            jsr hash_
+            set [-1+x], [c]         ; push it on its chain
+            set [c], x
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            ; ( -- )  rebuilds the whole index, for when words have moved
+            ; (see save-image in shake.ft)
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_rehash:    dw name_hashword
+            
+            dw 6
+            dzw "rehash"
+rehash:         
+            dw code_rehash
+code_rehash:
+            jsr rehash_
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            ; (re)build the whole index from the dictionary. this is done
+            ; once, on the first boot, since there's no easy way to hash the
+            ; built-in words at assembly time. everything goes at the end of
+            ; its chain, since we visit the newest words first.
+            ; clobbers a, b, c, j and x
+rehash_:    set c, buckets          ; clear out all the chains
+rehash_.1:  set [c], 0
+            add c, 1
+            ifg buckets_end, c
+            set pc, rehash_.1
+            set x, [var_latest]     ; start with most recent word
+rehash_.2:  ife x, 0                ; end of dict?
+            set pc, rehash_.4
+            set [-1+x], 0           ; this will be the end of its chain
+            set a, [1+x]            ; load len
+            and a, 0x1f
+            set b, x                ; and name
+            add b, 2
+            jsr hash_
+rehash_.3:  ife [c], 0              ; find the end of the chain
+            set pc, rehash_.5
+            set c, [c]
+            sub c, 1
+            set pc, rehash_.3
+rehash_.5:  set [c], x              ; and append
+            set x, [x]              ; next word in dict
+            set pc, rehash_.2
+rehash_.4:  set [hashed], 1
+            set pc, pop
+
+
+            ; ( addr -- xt )  addr points to start of dict entry
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_tocfa:    dw name_rehash
+            
+            dw 4
+            dzw ">cfa"
+tocfa:         
+            dw code_tocfa
+code_tocfa:
+            add [z], 1              ; advance to len field
+            set a, [z]              ; load len field addr
+            set a, [a]              ; load actual len field
+            and a, 0x1f        ; mask off the flags
+            add [z], 1              ; advance to start of name
+            add [z], a              ; advance to code ptr
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            ; ( xt -- addr )  data field of a word
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_tobody:    dw name_tocfa
+            
+            dw 5
+            dzw ">body"
+tobody:         
+            dw code_tobody
+code_tobody:
+            add [z], 1
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            ; the words below hide the difference between the threading
+            ; models from forth code. in both, an xt is the address of a
+            ; code field, which can be given to execute.
+
+            ; ( xt -- addr )  the machine code a word runs: docol, dovar,
+            ; etc., or the code of a primitive
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_tocodeaddr:    dw name_tobody
+            
+            dw 13
+            dzw ">code-address"
+tocodeaddr:         
+            dw code_tocodeaddr
+code_tocodeaddr:
+            set a, [z]
+
+            set [z], [a]
+
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            ; ( addr xt -- )  make a word run the machine code at addr
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_codeaddrstore:    dw name_tocodeaddr
+            
+            dw 13
+            dzw "code-address!"
+codeaddrstore:         
+            dw code_codeaddrstore
+code_codeaddrstore:
+            set a, [z]
+
+            set [a], [1+z]
+
+            add z, 2
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+            ; ( "name" -- )  create a primitive. its machine code
+            ; follows at here, and should finish with end-code.
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_createcode:    dw name_codeaddrstore
+            
+            dw 11
+            dzw "create-code"
+createcode:         
+            dw docol
+            dw create
+
+            dw here, latest, fetch  ; the code field points to the code
+            dw tocfa, store
+
+            dw exit
+
+            ; ( -- )  finish off a primitive by compiling next
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_endcode:    dw name_createcode
+            
+            dw 8
+            dzw "end-code"
+endcode:         
+            dw code_endcode
+code_endcode:
+            set a, nextcode_
+endcode.1:  set j, [a]
+            jsr comma_              ; compile the word in j
+            add a, 1
+            ifg nextcode_end, a     ; until the end of the copy
+            set pc, endcode.1
+            set x, [y]
+            add y, 1
+            set pc, [x]
+nextcode_:  set x, [y]
+            add y, 1
+            set pc, [x]
+nextcode_end:
+
+; the outer interpreter
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_succ:    dw name_endcode
+            
+            dw 4
+            dzw "succ"
+succ:         
+            dw dovar
+var_succ:     dw 0
+
+
+            ; ( -- ? )
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_interpret:    dw name_succ
+            
+            dw 9
+            dzw "interpret"
+interpret:         
+            dw docol
+            dw state, fetch         ; if we're currently in compile mode...
+            dw zbranch, 2
+            dw rbrac                ; resume compiling, until finished
+            dw parseword            ; otherwise (or and then) interpret...
+            dw dup, zbranch, 8      ; done?
+            dw interpret_           ; call the primitive
+            dw succ, fetch          ; check for error
+            dw zbranch, 7           ; error!
+            dw branch, -10          ; keep parsing...
+            dw twodrop, lit, 0xffff ; push true
+            dw exit
+            dw lit, 0x0             ; push false
+            dw exit
+
+            ; this can't return anything, since execution will cause us to
+            ; eventually next our way back into forth code. we could make
+            ; it work by fiddling around with the forth y, but it doesn't seem
+            ; worth it... we use a var to communicate errors...
+            ; ( a u -- )
+interpret_: dw interp_
+interp_:    set a, [z]              ; load length
+            set b, [1+z]              ; load ptr
+            add z, 2
+            set [var_succ], 0xffff
+            jsr find_               ; dictionary search, results in x, j
+            ife x, 0
+            set pc, interp_.1       ; not in dict...
+            set x, j                ; found. update the codeword pointer
+            set pc, [x]                  ; and execute it...
+interp_.1:  set x, 0                ; no accumulator so far...
+            jsr number_
+            ife a, 0
+            set pc, interp_.2
+            set [var_succ], 0x0     ; not a number. bail.
+            set pc, interp_.3
+interp_.2:  sub z, 1                ; got a number. push it.
+            set [z], x
+interp_.3:  set x, [y]
+            add y, 1
+            set pc, [x]
+
+
+; boot is basically a simplified quit, without the prompts...
+; we just use this to achieve a quiet bootup while executing forth.ft.
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_boot:    dw name_interpret
+            
+            dw 4
+            dzw "boot"
+boot:         
+            dw docol
+            dw refill, drop         ; refill input buffer
+            dw interpret, zequ      ; run
+            dw zbranch, 2           ; check result
+            dw err
+            dw branch, -8           ; again
+
+; just a minimal indication that an error occurred during boostrap
+err:        dw err_
+err_:       set j, 0x45
+            jsr emit_
+            set x, [y]
+            add y, 1
+            set pc, [x]
+
+; we indirect the actual boot through a variable, so that we can reset
+; the boot word before saving the final image.
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_bootword:    dw name_boot
+            
+            dw 9
+            dzw "boot-word"
+bootword:         
+            dw dovar
+var_bootword:     dw boot
+
+; define h down here, so it's clear where it's coming from...
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_h:    dw name_bootword
+            
+            dw 1
+            dzw "h"
+h:         
+            dw dovar
+var_h:     dw h_init
+
+; define latest last, so that it can start out pointing to itself.
+            
+            
+            dw 0                    ; hash chain, set up at boot
+name_latest:    dw name_h
+            
+            dw 6
+            dzw "latest"
+latest:         
+            dw dovar
+var_latest:     dw name_latest
+
+; the dictionary index: 64 chains of words by hash (see find_). this
+; has to be saved with the image, so it also goes below h.
+hashed:     dw 0                    ; set once the index has been built
+buckets:    dw 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+            dw 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+            dw 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+            dw 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+buckets_end:
+; label for initial value for h
+h_init:     ; nothing here!
+
+; the fun continues in forth.ft...